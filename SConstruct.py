@@ -1,6 +1,9 @@
 """SConstruct file that builds:
     - kpabe static lib
     - main.cpp
+    - the kpabe command-line tool
+    - the kpabed decryption daemon and its kpabe_load client
+    - the kpabe_footprint bounded-memory harness
     - unittests
 """
 import os
@@ -24,6 +27,7 @@ def getNativeEnv():
       "gmp",
       "mbedcrypto",
       "m",
+      "pthread",
     ]
 
     env = DefaultEnvironment(CXXFLAGS=CXXFLAGS + ["-Os"] + INCLUDES,
@@ -34,7 +38,8 @@ def getNativeEnv():
 def getKpabeLib(env):
     """Get target for kpabe static lib.
     """
-    return env.StaticLibrary("kpabe", ["kpabe.cpp"])
+    return env.StaticLibrary("kpabe", ["kpabe.cpp", "kpabe_bounded.cpp", "kpabe_random.cpp",
+                                       "kpabe_typea.cpp"])
 
 def getTestsTarget(env):
     """Get test targets.
@@ -60,10 +65,38 @@ def getMainTarget(env):
     mainEnv["LIBS"].insert(0, "kpabe")
     return mainEnv.Program("main", "#main.cpp")
 
+def getToolObject(env):
+    """Get the object with the helpers shared by the command-line tools.
+    """
+    return env.Object("#kpabe_tool.cpp")
+
+def getCliTarget(env):
+    """Get target for the kpabe command-line tool.
+    """
+    cliEnv = env.Clone()
+    cliEnv["LIBS"].insert(0, "kpabe")
+    return cliEnv.Program("kpabe", ["#kpabe_cli.cpp", getToolObject(env)])
+
+def getDaemonTargets(env):
+    """Get targets for the decryption daemon and its load generator.
+    """
+    daemonEnv = env.Clone()
+    daemonEnv["LIBS"].insert(0, "kpabe")
+    return [daemonEnv.Program("kpabed", ["#kpabed.cpp", getToolObject(env)]),
+            daemonEnv.Program("kpabe_load", ["#kpabe_load.cpp", getToolObject(env)])]
+
+def getFootprintTarget(env):
+    """Get target for the bounded decryption footprint harness.
+    """
+    footprintEnv = env.Clone()
+    footprintEnv["LIBS"].insert(0, "kpabe")
+    return footprintEnv.Program("kpabe_footprint", "#kpabe_footprint.cpp")
+
 def getAllTargets(env):
     """Get all targets.
     """
-    targets = getTestsTarget(env) + getMainTarget(env)
+    targets = (getTestsTarget(env) + getMainTarget(env) + getCliTarget(env) +
+               getDaemonTargets(env) + getFootprintTarget(env))
     return targets
 
 env = getNativeEnv()
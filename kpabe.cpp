@@ -5,6 +5,13 @@
 #include <numeric>
 #include <functional>
 #include <array>
+#include <cctype>
+#include <limits>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <iterator>
 #include <vector>
 
 #include <mbedtls/cipher.h>
@@ -12,6 +19,8 @@
 #include <pbc.h>
 
 #include "kpabe.hpp"
+#include "kpabe_random.hpp"
+#include "kpabe_typea.hpp"
 
 using namespace std;
 
@@ -25,6 +34,7 @@ bool isInit = false;
 pairing_ptr getPairing() {
    if(!isInit) {
       pairing_init_set_str(&pairing, TYPE_A_PARAMS.c_str());
+      initRandom();
       isInit = true;
    }
    return &pairing;
@@ -32,14 +42,112 @@ pairing_ptr getPairing() {
 
 void hashElement(element_t e, uint8_t* hashBuf) {
    const int elementSize = element_length_in_bytes(e);
-   uint8_t* elementBytes = new uint8_t[elementSize + 1];
+   // G1 elements fit on the stack, which keeps bounded decryption off the heap.
+   uint8_t stackBytes[256];
+   vector<uint8_t> heapBytes;
+   uint8_t* elementBytes = stackBytes;
+   if(elementSize > static_cast<int>(sizeof(stackBytes))) {
+      heapBytes.resize(elementSize);
+      elementBytes = heapBytes.data();
+   }
    element_to_bytes(elementBytes, e);
 
    //TODO: use mbedtls_sha256
    auto mdInfo = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
    mbedtls_md(mdInfo, elementBytes, elementSize, hashBuf);
-   
-   delete [] elementBytes;
+}
+
+void powG1(element_t out, element_t base, element_t exponent) {
+#ifdef KPABE_PBC_ARITHMETIC
+   element_pow_zn(out, base, exponent);
+#else
+   const int pointLen = element_length_in_bytes(base);
+   const int exponentLen = element_length_in_bytes(exponent);
+   if(pointLen != 2 * typea::FIELD_BYTES || exponentLen > 32) {
+      // Not a Type A point or scalar; leave it to PBC.
+      element_pow_zn(out, base, exponent);
+      return;
+   }
+   if(element_is0(base)) {
+      element_set0(out);
+      return;
+   }
+
+   uint8_t pointBytes[2 * typea::FIELD_BYTES];
+   uint8_t exponentBytes[32];
+   element_to_bytes(pointBytes, base);
+   element_to_bytes(exponentBytes, exponent);
+
+   typea::AffinePoint point;
+   point.infinity = false;
+   if(!typea::fpFromBytes(point.x, pointBytes) ||
+      !typea::fpFromBytes(point.y, pointBytes + typea::FIELD_BYTES)) {
+      element_pow_zn(out, base, exponent);
+      return;
+   }
+
+   typea::scalarMul(point, point, exponentBytes, exponentLen);
+   if(point.infinity) {
+      element_set0(out);
+      return;
+   }
+   typea::fpToBytes(pointBytes, point.x);
+   typea::fpToBytes(pointBytes + typea::FIELD_BYTES, point.y);
+   element_from_bytes(out, pointBytes);
+#endif
+}
+
+// The group order r = 2^159 + 2^107 + 1 of TYPE_A_PARAMS, big-endian.
+static const uint8_t GROUP_ORDER[20] = {
+   0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00,
+   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+};
+
+bool isInG1Subgroup(element_t point) {
+   if(element_is0(point)) {
+      return true;
+   }
+#ifndef KPABE_PBC_ARITHMETIC
+   if(element_length_in_bytes(point) == 2 * typea::FIELD_BYTES) {
+      uint8_t pointBytes[2 * typea::FIELD_BYTES];
+      element_to_bytes(pointBytes, point);
+      typea::AffinePoint affine;
+      affine.infinity = false;
+      if(!typea::fpFromBytes(affine.x, pointBytes) ||
+         !typea::fpFromBytes(affine.y, pointBytes + typea::FIELD_BYTES)) {
+         return false;
+      }
+
+      // On the curve: y^2 = x^3 + x.
+      typea::Fp lhs, rhs;
+      typea::fpSqr(lhs, affine.y);
+      typea::fpSqr(rhs, affine.x);
+      typea::fpMul(rhs, rhs, affine.x);
+      typea::fpAdd(rhs, rhs, affine.x);
+      typea::fpSub(lhs, lhs, rhs);
+      if(!typea::fpIsZero(lhs)) {
+         return false;
+      }
+
+      typea::scalarMul(affine, affine, GROUP_ORDER, sizeof(GROUP_ORDER));
+      return affine.infinity;
+   }
+#endif
+   element_t multiple;
+   element_init_same_as(multiple, point);
+   element_pow_mpz(multiple, point, getPairing()->r);
+   const bool inSubgroup = element_is0(multiple);
+   element_clear(multiple);
+   return inSubgroup;
+}
+
+bool isValidCw(Cw_t& Cw) {
+   for(auto& attrCiPair: Cw) {
+      if(!isInG1Subgroup(&attrCiPair.second)) {
+         return false;
+      }
+   }
+   return true;
 }
 
 /**
@@ -65,6 +173,34 @@ void symDecrypt(const uint8_t* input, size_t ilen, uint8_t* key, uint8_t* output
    mbedtlsSymCrypt(input, ilen, key, output, olen, MBEDTLS_DECRYPT);
 }
 
+// Below this many items, parallelFor does not spawn threads.
+static const size_t PARALLEL_MIN_CHUNK = 64;
+
+/**
+ * Calls func(begin, end) on consecutive chunks of [0, count), one chunk per hardware
+ * thread.
+ */
+static void parallelFor(size_t count, const function<void (size_t, size_t)>& func) {
+   const size_t hardwareThreads = max(1u, thread::hardware_concurrency());
+   const size_t threadCount = min(hardwareThreads,
+                                  (count + PARALLEL_MIN_CHUNK - 1) / PARALLEL_MIN_CHUNK);
+   if(threadCount <= 1) {
+      func(0, count);
+      return;
+   }
+
+   const size_t chunk = (count + threadCount - 1) / threadCount;
+   vector<thread> workers;
+   workers.reserve(threadCount - 1);
+   for(size_t begin = chunk; begin < count; begin += chunk) {
+      workers.emplace_back(func, begin, min(count, begin + chunk));
+   }
+   func(0, min(count, chunk));
+   for(auto& worker: workers) {
+      worker.join();
+   }
+}
+
 // Node
 
 Node::Node(const Node& other) {
@@ -73,7 +209,7 @@ Node::Node(const Node& other) {
    children = other.children;
 }
 
-Node::Node(Node&& other):
+Node::Node(Node&& other) noexcept:
    attr(move(other.attr)),
    type(other.type),
    children(move(other.children)) {
@@ -83,8 +219,8 @@ Node::Node(int attr) {
    this->attr = attr;
 }
 
-Node::Node(Type type, const vector<Node>& children) {
-   this->children = children;
+Node::Node(Type type, vector<Node> children) {
+   this->children = move(children);
    this->type = type;
 }
 
@@ -136,29 +272,51 @@ unsigned int Node::getPolyDegree() const {
    return getThreshold() - 1;
 }
 
-vector<element_s> Node::splitShares(element_s& rootSecret) {
+string Node::toString() const {
+   if(children.empty()) {
+      return to_string(attr);
+   }
+   string result;
+   for(const Node& child: children) {
+      if(!result.empty()) {
+         result += type == Type::AND ? " AND " : " OR ";
+      }
+      if(child.children.empty()) {
+         result += child.toString();
+      } else {
+         result += "(" + child.toString() + ")";
+      }
+   }
+   return result;
+}
+
+/**
+ * Shamir-splits the secret into count shares, p(1)..p(count), of a random polynomial of
+ * degree threshold - 1 with p(0) = rootSecret.
+ */
+static vector<element_s> splitSecret(element_s& rootSecret, unsigned int threshold,
+                                     size_t count) {
    // Generate the coefficients for the polynomial.
-   auto threshold = getThreshold();
    vector<element_s> coeff(threshold);
    
    element_init_same_as(&coeff[0], &rootSecret);
    element_set(&coeff[0], &rootSecret);
    
    // Generate random coefficients, except for q(0), which is set to the rootSecret.
-   for(int i = 1; i <= getPolyDegree(); ++i) {
+   for(int i = 1; i < threshold; ++i) {
       element_init_same_as(&coeff[i], &rootSecret);
       element_random(&coeff[i]);
    }
 
    // Calculate the shares for each child.
-   vector<element_s> shares(children.size());
+   vector<element_s> shares(count);
    
    element_t temp;
    element_init_Zr(temp, getPairing());
 
    // The scheme decription defines an ordering on the children in a node (index(x)).
    // Here, we implicitly use a left to right order.
-   for(int x = 1; x <= children.size(); ++x) {
+   for(int x = 1; x <= count; ++x) {
       auto share = &shares[x - 1];
       element_init_same_as(share, &rootSecret);
       element_set0(share);
@@ -176,6 +334,10 @@ vector<element_s> Node::splitShares(element_s& rootSecret) {
    }
    
    return shares;
+}
+
+vector<element_s> Node::splitShares(element_s& rootSecret) {
+   return splitSecret(rootSecret, getThreshold(), children.size());
 }//splitShares
 
 vector<element_s> Node::getSecretShares(element_s& rootSecret) {
@@ -195,8 +357,10 @@ vector<element_s> Node::getSecretShares(element_s& rootSecret) {
    return shares;
 }
 
-vector<element_s> Node::recoverCoefficients() {
-   auto threshold = getThreshold();
+/**
+ * Computes the Lagrange coefficients for interpolating p(0) from the points 1..threshold.
+ */
+static vector<element_s> lagrangeCoefficients(unsigned int threshold) {
    vector<element_s> coeff(threshold);
 
    element_t iVal, jVal, temp;
@@ -228,27 +392,67 @@ vector<element_s> Node::recoverCoefficients() {
    return coeff;
 }
 
+vector<element_s> Node::recoverCoefficients() {
+   return lagrangeCoefficients(getThreshold());
+}
+
+
+static size_t leafCount(const Node& node) {
+   size_t count = node.getChildren().empty() ? 1 : 0;
+   for(const Node& child: node.getChildren()) {
+      count += leafCount(child);
+   }
+   return count;
+}
 
 vector< pair<int, element_s> >
 Node::satisfyingAttributes(const vector<int>& attributes,
                            element_s& currentCoeff) {
+   auto leafs = getLeafs();
    vector< pair<int, element_s> > sat;
+   for(auto& leafCoeffPair: satisfyingLeafs(attributes, currentCoeff)) {
+      sat.push_back({leafs[leafCoeffPair.first], leafCoeffPair.second});
+   }
+   return sat;
+}
+
+vector< pair<size_t, element_s> >
+Node::satisfyingLeafs(const vector<int>& attributes,
+                      element_s& currentCoeff,
+                      size_t firstLeaf) {
+   size_t leafs;
+   return satisfyingLeafs(attributes, currentCoeff, firstLeaf, leafs);
+}
+
+vector< pair<size_t, element_s> >
+Node::satisfyingLeafs(const vector<int>& attributes,
+                      element_s& currentCoeff,
+                      size_t firstLeaf,
+                      size_t& leafs) {
+   vector< pair<size_t, element_s> > sat;
 
    if (children.empty()) {
+      leafs = 1;
       if(find(attributes.begin(), attributes.end(), attr) != attributes.end()) {
-         sat.push_back({attr, currentCoeff});
+         sat.push_back({firstLeaf, currentCoeff});
       }
    } else {
       auto recCoeffs = recoverCoefficients();
+      size_t childLeaf = firstLeaf;
+      size_t childLeafs;
+      size_t visited = children.size();
       
       if(type == Type::AND) {
          bool allSatisfied = true;
-         vector< pair<int, element_s> > totalChildSat;
+         vector< pair<size_t, element_s> > totalChildSat;
          for(int i = 0; i < children.size(); ++i) {
             element_mul(&recCoeffs[i], &recCoeffs[i], &currentCoeff);
-            auto childSat = children[i].satisfyingAttributes(attributes, recCoeffs[i]);
+            auto childSat = children[i].satisfyingLeafs(attributes, recCoeffs[i], childLeaf,
+                                                        childLeafs);
+            childLeaf += childLeafs;
             if(childSat.empty()) {
                allSatisfied = false;
+               visited = i + 1;
                break;
             }
             totalChildSat.reserve(totalChildSat.size() + childSat.size());
@@ -260,16 +464,25 @@ Node::satisfyingAttributes(const vector<int>& attributes,
       } else {
          auto& recCoeff0 = recCoeffs[0];
          element_mul(&recCoeff0, &recCoeff0, &currentCoeff);
-         for (auto& child: children) {
+         for(int i = 0; i < children.size(); ++i) {
             // TODO: Optimization -
             // Should return the shortest non-empty childSat instead of the first one.
-            auto childSat = child.satisfyingAttributes(attributes, recCoeff0);
+            auto childSat = children[i].satisfyingLeafs(attributes, recCoeff0, childLeaf,
+                                                        childLeafs);
+            childLeaf += childLeafs;
             if(!childSat.empty()){
                sat = childSat;
+               visited = i + 1;
                break;
             }
          }
       }
+
+      // The children after the one that decided the gate are only counted.
+      for(size_t i = visited; i < children.size(); ++i) {
+         childLeaf += leafCount(children[i]);
+      }
+      leafs = childLeaf - firstLeaf;
    }
    
    return sat;
@@ -279,23 +492,383 @@ const vector<Node>& Node::getChildren() const {
    return children;
 }
 
+Node::Type Node::getType() const {
+   return type;
+}
+
+// PolicyTerm
+
+PolicyTerm::PolicyTerm(Node::Type type, int attr, vector<const PolicyTerm*> children,
+                       size_t hash):
+   type(type), attr(attr), children(move(children)), hash(hash) {
+   if(this->children.empty()) {
+      leafs.push_back(attr);
+   } else {
+      for(auto child: this->children) {
+         leafs.insert(leafs.end(), child->leafs.begin(), child->leafs.end());
+      }
+   }
+}
+
+bool PolicyTerm::isLeaf() const {
+   return children.empty();
+}
+
+unsigned int PolicyTerm::getThreshold() const {
+   return type == Node::Type::OR ? 1 : static_cast<unsigned int>(children.size());
+}
+
+const vector<int>& PolicyTerm::getLeafs() const {
+   return leafs;
+}
+
+Node PolicyTerm::toNode() const {
+   if(isLeaf()) {
+      return Node(attr);
+   }
+   Node node(type);
+   for(auto child: children) {
+      node.addChild(child->toNode());
+   }
+   return node;
+}
+
+// PolicyPool
+
+bool PolicyPool::TermKey::operator==(const TermKey& other) const {
+   return type == other.type && attr == other.attr && children == other.children;
+}
+
+size_t PolicyPool::TermKeyHash::operator()(const TermKey& key) const {
+   // Children are interned, so hashing their cached hashes hashes the whole subtree.
+   size_t seed = hash<int>()(key.type) * 31 + hash<int>()(key.attr);
+   for(auto child: key.children) {
+      seed ^= child->hash + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+   }
+   return seed;
+}
+
+PolicyPool::Ref PolicyPool::intern(Node::Type type, int attr, vector<Ref> children) {
+   TermKey key {type, attr, move(children)};
+   auto termIter = terms.find(key);
+   if(termIter != terms.end()) {
+      return termIter->second.get();
+   }
+
+   const size_t keyHash = TermKeyHash()(key);
+   unique_ptr<PolicyTerm> term(new PolicyTerm(type, attr, key.children, keyHash));
+   Ref ref = term.get();
+   terms.emplace(move(key), move(term));
+   return ref;
+}
+
+PolicyPool::~PolicyPool() {
+   for(auto& thresholdCoeffPair: coefficientCache) {
+      for(element_s& coeff: thresholdCoeffPair.second) {
+         element_clear(&coeff);
+      }
+   }
+   for(auto& termPlanPair: plans) {
+      for(auto& leafCoeffPair: termPlanPair.second) {
+         element_clear(&leafCoeffPair.second);
+      }
+   }
+}
+
+PolicyPool::Ref PolicyPool::leaf(int attr) {
+   // Leafs have no gate type, use a fixed one so equal attributes intern to one term.
+   return intern(Node::Type::OR, attr, { });
+}
+
+PolicyPool::Ref PolicyPool::gate(Node::Type type, vector<Ref> children) {
+   return intern(type, 0, move(children));
+}
+
+const vector<element_s>& PolicyPool::coefficients(Ref term) {
+   return thresholdCoefficients(term->getThreshold());
+}
+
+vector<element_s>& PolicyPool::thresholdCoefficients(unsigned int threshold) {
+   auto coeffIter = coefficientCache.find(threshold);
+   if(coeffIter == coefficientCache.end()) {
+      coeffIter = coefficientCache.emplace(threshold, lagrangeCoefficients(threshold)).first;
+   }
+   return coeffIter->second;
+}
+
+const PolicyPool::TermPlan& PolicyPool::plan(Ref term, const vector<int>& attributes) {
+   vector<int> attributeSet(attributes);
+   sort(attributeSet.begin(), attributeSet.end());
+   attributeSet.erase(unique(attributeSet.begin(), attributeSet.end()), attributeSet.end());
+   auto setIter = attributeSets.emplace(move(attributeSet), attributeSets.size()).first;
+   return plan(term, setIter->second, setIter->first);
+}
+
+const PolicyPool::TermPlan& PolicyPool::plan(Ref term, size_t setId,
+                                             const vector<int>& attributeSet) {
+   const auto planKey = make_pair(term, setId);
+   auto planIter = plans.find(planKey);
+   if(planIter != plans.end()) {
+      return planIter->second;
+   }
+   ++evaluations;
+
+   // The same selection as Node::satisfyingLeafs, with leafs relative to the term.
+   TermPlan termPlan;
+   if(term->isLeaf()) {
+      if(binary_search(attributeSet.begin(), attributeSet.end(), term->attr)) {
+         termPlan.push_back({0, element_s()});
+         element_init_Zr(&termPlan.back().second, getPairing());
+         element_set1(&termPlan.back().second);
+      }
+   } else {
+      auto& coeffs = thresholdCoefficients(term->getThreshold());
+      const bool isAnd = term->type == Node::Type::AND;
+      size_t firstLeaf = 0;
+      for(size_t i = 0; i < term->children.size(); ++i) {
+         const auto child = term->children[i];
+         const TermPlan& childPlan = plan(child, setId, attributeSet);
+         if(childPlan.empty() && isAnd) {
+            for(auto& leafCoeffPair: termPlan) {
+               element_clear(&leafCoeffPair.second);
+            }
+            termPlan.clear();
+            break;
+         }
+         for(auto& leafCoeffPair: childPlan) {
+            termPlan.push_back({firstLeaf + leafCoeffPair.first, element_s()});
+            element_s& coeff = termPlan.back().second;
+            element_init_Zr(&coeff, getPairing());
+            element_mul(&coeff, const_cast<element_s*>(&leafCoeffPair.second),
+                        &coeffs[isAnd ? i : 0]);
+         }
+         if(!childPlan.empty() && !isAnd) {
+            break;
+         }
+         firstLeaf += child->getLeafs().size();
+      }
+   }
+   return plans.emplace(planKey, move(termPlan)).first->second;
+}
+
+size_t PolicyPool::planEvaluations() const {
+   return evaluations;
+}
+
+size_t PolicyPool::size() const {
+   return terms.size();
+}
+
+// Policies come from untrusted input (deserializeKey), so bound the parser's recursion.
+static const size_t MAX_POLICY_NESTING = 64;
+
+/**
+ * Builds interned terms in a pool.
+ */
+struct PoolBuilder {
+   typedef PolicyPool::Ref Ref;
+
+   PolicyPool& pool;
+
+   Ref leaf(int attr) {
+      return pool.leaf(attr);
+   }
+
+   Ref gate(Node::Type type, vector<Ref> children) {
+      return pool.gate(type, move(children));
+   }
+};
+
+/**
+ * Builds a Node tree, moving every child into its parent.
+ */
+struct NodeBuilder {
+   typedef Node Ref;
+
+   Ref leaf(int attr) {
+      return Node(attr);
+   }
+
+   Ref gate(Node::Type type, vector<Ref> children) {
+      return Node(type, move(children));
+   }
+};
+
+/**
+ * Recursive descent parser for policy strings:
+ *
+ *    or      := and ("OR" and)*
+ *    and     := operand ("AND" operand)*
+ *    operand := attribute | "(" or ")"
+ */
+template<class Builder>
+class PolicyParser {
+   typedef typename Builder::Ref Ref;
+
+   Builder builder;
+   const string& text;
+   size_t pos = 0;
+   size_t nesting = 0;
+
+   [[noreturn]] void fail(const string& what) const {
+      throw PolicyParseError(what + " at position " + to_string(pos) + " in \"" + text + "\"");
+   }
+
+   void skipSpace() {
+      while(pos < text.size() && isspace(static_cast<unsigned char>(text[pos]))) {
+         ++pos;
+      }
+   }
+
+   // Consumes the given keyword if it is next and not followed by an identifier character.
+   bool keyword(const char* word, size_t len) {
+      skipSpace();
+      if(text.size() - pos < len) {
+         return false;
+      }
+      for(size_t i = 0; i < len; ++i) {
+         if(toupper(static_cast<unsigned char>(text[pos + i])) != word[i]) {
+            return false;
+         }
+      }
+      if(pos + len < text.size() && isalnum(static_cast<unsigned char>(text[pos + len]))) {
+         return false;
+      }
+      pos += len;
+      return true;
+   }
+
+   Ref parseOperand() {
+      skipSpace();
+      if(pos == text.size()) {
+         fail("Unexpected end of policy");
+      }
+      if(text[pos] == '(') {
+         if(++nesting > MAX_POLICY_NESTING) {
+            fail("Policy nested too deeply");
+         }
+         ++pos;
+         auto term = parseOr();
+         skipSpace();
+         if(pos == text.size() || text[pos] != ')') {
+            fail("Expected ')'");
+         }
+         ++pos;
+         --nesting;
+         return term;
+      }
+
+      const size_t start = pos;
+      if(text[pos] == '-') {
+         ++pos;
+      }
+      long long value = 0;
+      size_t digits = 0;
+      for(; pos < text.size() && isdigit(static_cast<unsigned char>(text[pos])); ++pos, ++digits) {
+         value = value * 10 + (text[pos] - '0');
+         if(value > numeric_limits<int>::max()) {
+            pos = start;
+            fail("Attribute out of range");
+         }
+      }
+      if(digits == 0) {
+         pos = start;
+         fail("Expected an attribute or '('");
+      }
+      return builder.leaf(static_cast<int>(text[start] == '-' ? -value : value));
+   }
+
+   Ref parseGate(Node::Type type) {
+      vector<Ref> children;
+      if(type == Node::Type::OR) {
+         children.push_back(parseGate(Node::Type::AND));
+         while(keyword("OR", 2)) {
+            children.push_back(parseGate(Node::Type::AND));
+         }
+      } else {
+         children.push_back(parseOperand());
+         while(keyword("AND", 3)) {
+            children.push_back(parseOperand());
+         }
+      }
+      if(children.size() == 1) {
+         return move(children[0]);
+      }
+      return builder.gate(type, move(children));
+   }
+
+   Ref parseOr() {
+      return parseGate(Node::Type::OR);
+   }
+
+public:
+   PolicyParser(Builder builder, const string& text): builder(builder), text(text) { }
+
+   Ref parse() {
+      auto term = parseOr();
+      skipSpace();
+      if(pos != text.size()) {
+         fail("Unexpected input");
+      }
+      return term;
+   }
+};
+
+PolicyPool::Ref PolicyPool::parse(const string& policy) {
+   return PolicyParser<PoolBuilder>(PoolBuilder {*this}, policy).parse();
+}
+
+Node parsePolicy(const string& policy) {
+   return PolicyParser<NodeBuilder>(NodeBuilder(), policy).parse();
+}
+
 // DecryptionKey
 
 DecryptionKey::DecryptionKey(const Node& policy): accessPolicy(policy) { }
 
 // Algorithm Setup
 
+/**
+ * Throws if an attribute is already in the universe or is listed twice.
+ */
+static void checkNewAttributes(const vector<int>& attributes, PrivateParams& privateParams) {
+   set<int> added;
+   for(auto attr: attributes) {
+      if(privateParams.Si.count(attr) || !added.insert(attr).second) {
+         throw invalid_argument("Attribute " + to_string(attr) + " already exists");
+      }
+   }
+}
+
 void setup(const vector<int>& attributes,
            PublicParams& publicParams,
            PrivateParams& privateParams) {
+   // Before initializing anything, so that nothing leaks.
+   checkNewAttributes(attributes, privateParams);
+
    element_init_Zr(&privateParams.mk, getPairing());
    element_random(&privateParams.mk);
    
-   element_t g;
-   element_init_G1(g, getPairing());
-   element_random(g);
+   element_init_G1(&publicParams.g, getPairing());
+   element_random(&publicParams.g);
+   element_init_G1(&privateParams.g, getPairing());
+   element_set(&privateParams.g, &publicParams.g);
    
-   // Generate a random public and private element for each attribute
+   element_init_G1(&publicParams.pk, getPairing());
+   powG1(&publicParams.pk, &publicParams.g, &privateParams.mk);
+
+   addAttributes(attributes, publicParams, privateParams);
+}
+
+void addAttributes(const vector<int>& attributes,
+                   PublicParams& publicParams,
+                   PrivateParams& privateParams) {
+   checkNewAttributes(attributes, privateParams);
+
+   // Draw the private elements serially (cheap, and keeps seeded runs reproducible),
+   // then compute the public elements in parallel.
+   vector< pair<element_s*, element_s*> > siPiPairs;
+   siPiPairs.reserve(attributes.size());
    for(auto attr: attributes) {
       // private
       element_s& si = privateParams.Si[attr];
@@ -305,12 +878,84 @@ void setup(const vector<int>& attributes,
       // public
       element_s& Pi = publicParams.Pi[attr];
       element_init_G1(&Pi, getPairing());
-      element_pow_zn(&Pi, g, &si);
+      siPiPairs.push_back({&si, &Pi});
+   }
+
+   parallelFor(siPiPairs.size(), [&](size_t begin, size_t end) {
+      for(size_t i = begin; i < end; ++i) {
+         powG1(siPiPairs[i].second, &publicParams.g, siPiPairs[i].first);
+      }
+   });
+}
+
+RekeyTokens rotateAttributes(const vector<int>& attributes,
+                             PublicParams& publicParams,
+                             PrivateParams& privateParams) {
+   for(auto attr: attributes) {
+      if(!privateParams.Si.count(attr) || !publicParams.Pi.count(attr)) {
+         throw invalid_argument("Attribute " + to_string(attr) + " does not exist");
+      }
+   }
+
+   RekeyTokens tokens;
+   element_t newSi;
+   element_init_Zr(newSi, getPairing());
+   for(auto attr: attributes) {
+      if(tokens.count(attr)) {
+         continue;
+      }
+      element_s& si = privateParams.Si[attr];
+      element_random(newSi);
+
+      element_s& token = tokens[attr];
+      element_init_Zr(&token, getPairing());
+      element_div(&token, newSi, &si);
+      element_set(&si, newSi);
+   }
+   element_clear(newSi);
+
+   // Look the elements up serially, the workers must not touch the maps.
+   vector< pair<element_s*, element_s*> > siPiPairs;
+   siPiPairs.reserve(tokens.size());
+   for(auto& attrTokenPair: tokens) {
+      siPiPairs.push_back({&privateParams.Si.at(attrTokenPair.first),
+                           &publicParams.Pi.at(attrTokenPair.first)});
+   }
+   parallelFor(siPiPairs.size(), [&](size_t begin, size_t end) {
+      for(size_t i = begin; i < end; ++i) {
+         powG1(siPiPairs[i].second, &publicParams.g, siPiPairs[i].first);
+      }
+   });
+
+   return tokens;
+}
+
+void rekeyCiphertexts(RekeyTokens& tokens, Cw_t* ciphertexts, size_t count) {
+   parallelFor(count, [&](size_t begin, size_t end) {
+      for(size_t i = begin; i < end; ++i) {
+         Cw_t& Cw = ciphertexts[i];
+         for(auto& attrTokenPair: tokens) {
+            auto attrCiIter = Cw.find(attrTokenPair.first);
+            if(attrCiIter != Cw.end()) {
+               powG1(&attrCiIter->second, &attrCiIter->second, &attrTokenPair.second);
+            }
+         }
+      }
+   });
+}
+
+void rekeyCiphertexts(RekeyTokens& tokens, vector<Cw_t>& ciphertexts) {
+   rekeyCiphertexts(tokens, ciphertexts.data(), ciphertexts.size());
+}
+
+void rekeyKey(RekeyTokens& tokens, DecryptionKey& key) {
+   auto leafs = key.accessPolicy.getLeafs();
+   for(size_t leaf = 0; leaf < leafs.size(); ++leaf) {
+      auto attrTokenIter = tokens.find(leafs[leaf]);
+      if(attrTokenIter != tokens.end()) {
+         element_div(&key.Di[leaf], &key.Di[leaf], &attrTokenIter->second);
+      }
    }
-   
-   element_init_G1(&publicParams.pk, getPairing());
-   element_pow_zn(&publicParams.pk, g, &privateParams.mk);
-   element_clear(g);
 }
 
 /**
@@ -331,13 +976,11 @@ DecryptionKey _keyGeneration(element_s& rootSecret,
    auto shares = accessPolicy.getSecretShares(rootSecret);
    
    DecryptionKey key(accessPolicy);
-   auto attrIter = leafs.begin();
-   auto sharesIter = shares.begin();
-   // The below is: Du[attr] = shares[attr] / attributeSecrets[attr]
-   for(; attrIter != leafs.end(); ++attrIter, ++sharesIter) {
-      element_s& attrDi = key.Di[*attrIter];
-      element_init_Zr(&attrDi, getPairing());
-      scramblingFunc(&attrDi, &*sharesIter, &scramblingKeys[*attrIter]);
+   key.Di.resize(leafs.size());
+   // The below is: Du[leaf] = shares[leaf] / attributeSecrets[attr(leaf)]
+   for(size_t leaf = 0; leaf < leafs.size(); ++leaf) {
+      element_init_Zr(&key.Di[leaf], getPairing());
+      scramblingFunc(&key.Di[leaf], &shares[leaf], &scramblingKeys[leafs[leaf]]);
    }
    
    for(element_s& share: shares) {
@@ -353,6 +996,45 @@ DecryptionKey keyGeneration(PrivateParams& privateParams,
    return _keyGeneration(privateParams.mk, privateParams.Si, element_div, accessPolicy);
 }
 
+/**
+ * Appends the secret shares of the term's leafs, left to right. The shares are copies.
+ */
+static void termShares(PolicyPool::Ref term, element_s& secret, vector<element_s>& shares) {
+   if(term->isLeaf()) {
+      shares.push_back(element_s());
+      element_init_same_as(&shares.back(), &secret);
+      element_set(&shares.back(), &secret);
+      return;
+   }
+   auto childShares = splitSecret(secret, term->getThreshold(), term->children.size());
+   for(size_t i = 0; i < term->children.size(); ++i) {
+      termShares(term->children[i], childShares[i], shares);
+      element_clear(&childShares[i]);
+   }
+}
+
+DecryptionKey keyGeneration(PrivateParams& privateParams, PolicyPool::Ref policy) {
+   const auto& leafs = policy->getLeafs();
+   for(auto attr: leafs) {
+      if(!privateParams.Si.count(attr)) {
+         throw invalid_argument("Attribute " + to_string(attr) + " does not exist");
+      }
+   }
+
+   vector<element_s> shares;
+   shares.reserve(leafs.size());
+   termShares(policy, privateParams.mk, shares);
+
+   DecryptionKey key(policy->toNode());
+   key.Di.resize(leafs.size());
+   for(size_t leaf = 0; leaf < leafs.size(); ++leaf) {
+      element_init_Zr(&key.Di[leaf], getPairing());
+      element_div(&key.Di[leaf], &shares[leaf], &privateParams.Si.at(leafs[leaf]));
+      element_clear(&shares[leaf]);
+   }
+   return key;
+}
+
 Cw_t createSecret(PublicParams& params,
                   const vector<int>& attributes,
                   element_s& Cs) {
@@ -361,45 +1043,98 @@ Cw_t createSecret(PublicParams& params,
    element_random(k);
    
    element_init_G1(&Cs, getPairing());
-   element_pow_zn(&Cs, &params.pk, k);
+   powG1(&Cs, &params.pk, k);
    
    Cw_t Cw;
    for(auto attr: attributes) {
       element_s& i = Cw[attr];
       element_init_G1(&i, getPairing());
-      element_pow_zn(&i, &params.Pi[attr], k);
+      powG1(&i, &params.Pi[attr], k);
    }
    element_clear(k);
    
    return Cw;
 }
 
-void recoverSecret(DecryptionKey& key,
-                   Cw_t& Cw,
-                   const vector<int>& attributes,
-                   element_s& Cs) {
+DecryptionPlan::~DecryptionPlan() {
+   for(auto& attrExponentPair: exponents) {
+      element_clear(&attrExponentPair.second);
+   }
+}
+
+/**
+ * exponent(attr) = sum of Di * coeff(i) over the selected leafs i of attr, so that
+ * P(Ci ^ (Di * coeff(i))) takes one exponentiation per attribute.
+ */
+static DecryptionPlan combineExponents(DecryptionKey& key,
+                                       const vector<int>& leafs,
+                                       const vector< pair<size_t, element_s> >& selected) {
+   DecryptionPlan plan;
+   map<int, size_t> exponentIndex;
+   element_t term;
+   element_init_Zr(term, getPairing());
+   for(auto& leafCoeffPair: selected) {
+      element_mul(term, &key.Di[leafCoeffPair.first],
+                  const_cast<element_s*>(&leafCoeffPair.second));
+      const int attr = leafs[leafCoeffPair.first];
+      auto indexIter = exponentIndex.find(attr);
+      if(indexIter == exponentIndex.end()) {
+         exponentIndex[attr] = plan.exponents.size();
+         plan.exponents.push_back({attr, element_s()});
+         element_init_Zr(&plan.exponents.back().second, getPairing());
+         element_set(&plan.exponents.back().second, term);
+      } else {
+         element_s& exponent = plan.exponents[indexIter->second].second;
+         element_add(&exponent, &exponent, term);
+      }
+   }
+   element_clear(term);
+   return plan;
+}
+
+DecryptionPlan planDecryption(DecryptionKey& key, const vector<int>& attributes) {
    // Get attributes that can satisfy the policy (and their coefficients).
    element_t rootCoeff;
    element_init_Zr(rootCoeff, getPairing());
    element_set1(rootCoeff);
-   auto attrs = key.accessPolicy.satisfyingAttributes(attributes, *rootCoeff);
+   auto sat = key.accessPolicy.satisfyingLeafs(attributes, *rootCoeff);
    element_clear(rootCoeff);
 
-   if(attrs.empty()) {
+   if(sat.empty()) {
       throw UnsatError();
-      return;
    }
    
+   auto plan = combineExponents(key, key.accessPolicy.getLeafs(), sat);
+   for(auto& leafCoeffPair: sat) {
+      element_clear(&leafCoeffPair.second);
+   }
+   return plan;
+}
+
+DecryptionPlan planDecryption(DecryptionKey& key,
+                              PolicyPool& pool,
+                              PolicyPool::Ref policy,
+                              const vector<int>& attributes) {
+   const auto& leafs = policy->getLeafs();
+   if(key.Di.size() != leafs.size()) {
+      throw invalid_argument("Key was not generated for this policy");
+   }
+   const auto& termPlan = pool.plan(policy, attributes);
+   if(termPlan.empty()) {
+      throw UnsatError();
+   }
+   return combineExponents(key, leafs, termPlan);
+}
+
+void applyDecryption(DecryptionPlan& plan, Cw_t& Cw, element_s& Cs) {
    element_t Zy;
    element_init_G1(&Cs, getPairing());
    element_init_G1(Zy, getPairing());
    bool pastFirst = false; // Is this the first "part" of the product
    
-   // product = P(Ci ^ (Di * coeff(i)))
-   // NOTE: attrCoeffPair is modified
-   for(auto& attrCoeffPair: attrs) {
-      element_mul(&attrCoeffPair.second, &key.Di[attrCoeffPair.first], &attrCoeffPair.second);
-      element_pow_zn(Zy, &Cw[attrCoeffPair.first], &attrCoeffPair.second);
+   // product = P(Ci ^ exponent(i))
+   for(auto& attrExponentPair: plan.exponents) {
+      powG1(Zy, &Cw[attrExponentPair.first], &attrExponentPair.second);
    
       if (pastFirst) {
          element_mul(&Cs, &Cs, Zy);
@@ -409,12 +1144,17 @@ void recoverSecret(DecryptionKey& key,
       }
    }
    
-   for(auto& attrCoeffPair: attrs){
-      element_clear(&attrCoeffPair.second);
-   }
    element_clear(Zy);
 }
 
+void recoverSecret(DecryptionKey& key,
+                   Cw_t& Cw,
+                   const vector<int>& attributes,
+                   element_s& Cs) {
+   auto plan = planDecryption(key, attributes);
+   applyDecryption(plan, Cw, Cs);
+}
+
 std::vector<uint8_t> encrypt(PublicParams& params,
                              const vector<int>& attributes,
                              const string& message,
@@ -457,3 +1197,276 @@ string decrypt(DecryptionKey& key,
    
    return message;
 }
+
+// CiphertextIndex
+
+CiphertextIndex::Id CiphertextIndex::add(const vector<int>& attributes) {
+   const Id id = nextId++;
+   for(auto attr: attributes) {
+      auto& posting = postings[attr];
+      // Ids are handed out in increasing order, so the posting lists stay sorted.
+      if(posting.empty() || posting.back() != id) {
+         posting.push_back(id);
+      }
+   }
+   return id;
+}
+
+CiphertextIndex::Id CiphertextIndex::add(const Cw_t& Cw) {
+   vector<int> attributes;
+   attributes.reserve(Cw.size());
+   for(auto& attrCiPair: Cw) {
+      attributes.push_back(attrCiPair.first);
+   }
+   return add(attributes);
+}
+
+size_t CiphertextIndex::size() const {
+   return nextId;
+}
+
+vector<CiphertextIndex::Id> CiphertextIndex::candidates(const Node& policy) const {
+   const auto& children = policy.getChildren();
+   if(children.empty()) {
+      auto postingIter = postings.find(policy.attr);
+      if(postingIter == postings.end()) {
+         return { };
+      }
+      return postingIter->second;
+   }
+
+   vector<Id> result = candidates(children[0]);
+   vector<Id> merged;
+   for(auto childIter = children.begin() + 1; childIter != children.end(); ++childIter) {
+      // An AND over an empty set can never become satisfiable again.
+      if(policy.getType() == Node::Type::AND && result.empty()) {
+         break;
+      }
+      auto childIds = candidates(*childIter);
+      merged.clear();
+      if(policy.getType() == Node::Type::AND) {
+         set_intersection(result.begin(), result.end(), childIds.begin(), childIds.end(),
+                          back_inserter(merged));
+      } else {
+         set_union(result.begin(), result.end(), childIds.begin(), childIds.end(),
+                   back_inserter(merged));
+      }
+      result.swap(merged);
+   }
+   return result;
+}
+
+vector<CiphertextIndex::Id> CiphertextIndex::query(const Node& policy) const {
+   return candidates(policy);
+}
+
+vector<CiphertextIndex::Id> CiphertextIndex::query(const DecryptionKey& key) const {
+   return candidates(key.accessPolicy);
+}
+
+// Serialization
+
+static const uint32_t PUBLIC_PARAMS_TAG = 0x4250504b;  // "KPPB"
+static const uint32_t PRIVATE_PARAMS_TAG = 0x5650504b; // "KPPV"
+static const uint32_t KEY_TAG = 0x4c44504b;            // "KPDL", one share per leaf
+static const uint32_t CW_TAG = 0x5743504b;             // "KPCW"
+
+static void putU32(vector<uint8_t>& out, uint32_t value) {
+   for(int i = 0; i < 4; ++i) {
+      out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+   }
+}
+
+static void putElement(vector<uint8_t>& out, element_s& e) {
+   const int len = element_length_in_bytes(&e);
+   putU32(out, static_cast<uint32_t>(len));
+   const size_t offset = out.size();
+   out.resize(offset + len);
+   element_to_bytes(out.data() + offset, &e);
+}
+
+static void putElementList(vector<uint8_t>& out, vector<element_s>& elements) {
+   putU32(out, static_cast<uint32_t>(elements.size()));
+   for(auto& e: elements) {
+      putElement(out, e);
+   }
+}
+
+static void putElementMap(vector<uint8_t>& out, map<int, element_s>& elements) {
+   putU32(out, static_cast<uint32_t>(elements.size()));
+   for(auto& attrElementPair: elements) {
+      putU32(out, static_cast<uint32_t>(attrElementPair.first));
+      putElement(out, attrElementPair.second);
+   }
+}
+
+/**
+ * Bounds-checked cursor over serialized data.
+ */
+class Reader {
+   const uint8_t* data;
+   size_t len;
+   size_t pos = 0;
+
+public:
+   Reader(const uint8_t* data, size_t len): data(data), len(len) { }
+
+   size_t consumed() const {
+      return pos;
+   }
+
+   const uint8_t* take(size_t n) {
+      if(len - pos < n) {
+         throw invalid_argument("Serialized data is truncated");
+      }
+      auto bytes = data + pos;
+      pos += n;
+      return bytes;
+   }
+
+   uint32_t u32() {
+      auto bytes = take(4);
+      return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | static_cast<uint32_t>(bytes[3]) << 24;
+   }
+
+   void tag(uint32_t expected) {
+      if(u32() != expected) {
+         throw invalid_argument("Serialized data has the wrong type");
+      }
+   }
+
+   // e must be initialized to the expected type.
+   void element(element_s& e) {
+      const uint32_t elementLen = u32();
+      if(elementLen != static_cast<uint32_t>(element_length_in_bytes(&e))) {
+         throw invalid_argument("Serialized element has the wrong length");
+      }
+      element_from_bytes(&e, const_cast<uint8_t*>(take(elementLen)));
+   }
+
+   // Leaves elements empty if the data is malformed.
+   void elementList(vector<element_s>& elements, size_t expectedCount, bool isG1) {
+      if(u32() != expectedCount) {
+         throw invalid_argument("Serialized data has the wrong number of elements");
+      }
+      elements.resize(expectedCount);
+      size_t initialized = 0;
+      try {
+         for(auto& e: elements) {
+            if(isG1) {
+               element_init_G1(&e, getPairing());
+            } else {
+               element_init_Zr(&e, getPairing());
+            }
+            ++initialized;
+            element(e);
+         }
+      } catch(...) {
+         for(size_t i = 0; i < initialized; ++i) {
+            element_clear(&elements[i]);
+         }
+         elements.clear();
+         throw;
+      }
+   }
+
+   // Leaves elements unchanged if the data is malformed.
+   void elementMap(map<int, element_s>& elements, bool isG1) {
+      const uint32_t count = u32();
+      vector<int> added;
+      try {
+         for(uint32_t i = 0; i < count; ++i) {
+            const int attr = static_cast<int>(u32());
+            if(elements.count(attr)) {
+               throw invalid_argument("Serialized data has a duplicate attribute");
+            }
+            element_s& e = elements[attr];
+            added.push_back(attr);
+            if(isG1) {
+               element_init_G1(&e, getPairing());
+            } else {
+               element_init_Zr(&e, getPairing());
+            }
+            element(e);
+         }
+      } catch(...) {
+         for(int attr: added) {
+            element_clear(&elements[attr]);
+            elements.erase(attr);
+         }
+         throw;
+      }
+   }
+};
+
+void serializePublicParams(PublicParams& publicParams, vector<uint8_t>& out) {
+   putU32(out, PUBLIC_PARAMS_TAG);
+   putElement(out, publicParams.g);
+   putElement(out, publicParams.pk);
+   putElementMap(out, publicParams.Pi);
+}
+
+size_t deserializePublicParams(const uint8_t* data, size_t len, PublicParams& publicParams) {
+   Reader reader(data, len);
+   reader.tag(PUBLIC_PARAMS_TAG);
+   element_init_G1(&publicParams.g, getPairing());
+   reader.element(publicParams.g);
+   element_init_G1(&publicParams.pk, getPairing());
+   reader.element(publicParams.pk);
+   reader.elementMap(publicParams.Pi, true);
+   return reader.consumed();
+}
+
+void serializePrivateParams(PrivateParams& privateParams, vector<uint8_t>& out) {
+   putU32(out, PRIVATE_PARAMS_TAG);
+   putElement(out, privateParams.g);
+   putElement(out, privateParams.mk);
+   putElementMap(out, privateParams.Si);
+}
+
+size_t deserializePrivateParams(const uint8_t* data, size_t len, PrivateParams& privateParams) {
+   Reader reader(data, len);
+   reader.tag(PRIVATE_PARAMS_TAG);
+   element_init_G1(&privateParams.g, getPairing());
+   reader.element(privateParams.g);
+   element_init_Zr(&privateParams.mk, getPairing());
+   reader.element(privateParams.mk);
+   reader.elementMap(privateParams.Si, false);
+   return reader.consumed();
+}
+
+void serializeKey(DecryptionKey& key, vector<uint8_t>& out) {
+   putU32(out, KEY_TAG);
+   const string policy = key.accessPolicy.toString();
+   putU32(out, static_cast<uint32_t>(policy.size()));
+   out.insert(out.end(), policy.begin(), policy.end());
+   putElementList(out, key.Di);
+}
+
+size_t deserializeKey(const uint8_t* data, size_t len, DecryptionKey& key) {
+   Reader reader(data, len);
+   reader.tag(KEY_TAG);
+   const uint32_t policyLen = reader.u32();
+   auto policy = reinterpret_cast<const char*>(reader.take(policyLen));
+   try {
+      Node accessPolicy = parsePolicy(string(policy, policyLen));
+      key.accessPolicy = accessPolicy;
+   } catch(const PolicyParseError& e) {
+      throw invalid_argument(e.what());
+   }
+
+   reader.elementList(key.Di, key.accessPolicy.getLeafs().size(), false);
+   return reader.consumed();
+}
+
+void serializeCw(Cw_t& Cw, vector<uint8_t>& out) {
+   putU32(out, CW_TAG);
+   putElementMap(out, Cw);
+}
+
+size_t deserializeCw(const uint8_t* data, size_t len, Cw_t& Cw) {
+   Reader reader(data, len);
+   reader.tag(CW_TAG);
+   reader.elementMap(Cw, true);
+   return reader.consumed();
+}
@@ -2,9 +2,12 @@
 #define kpabe_
 
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 #include <exception>
+#include <stdexcept>
+#include <unordered_map>
 
 #include <pbc.h>
 
@@ -38,6 +41,22 @@ pairing_ptr getPairing();
  */
 void hashElement(element_t e, uint8_t* key);
 
+/**
+ * @brief Computes out = base ^ exponent in G1.
+ *
+ * Uses the fixed-width Montgomery backend for TYPE_A_PARAMS (see kpabe_typea.hpp),
+ * unless compiled with KPABE_PBC_ARITHMETIC. The result is identical to element_pow_zn.
+ */
+void powG1(element_t out, element_t base, element_t exponent);
+
+/**
+ * @brief Checks that a G1 element is a point of the order-r subgroup (r * P = O).
+ *
+ * Deserialized points are not checked; validate points from untrusted sources before
+ * using them with a key, or points of small order leak the key's exponents.
+ */
+bool isInG1Subgroup(element_t point);
+
 class Node {
    
 public:
@@ -49,17 +68,25 @@ private:
    Type type;
    std::vector<Node> children;
 
+   // Also sets leafs to the number of leafs under this node.
+   std::vector< std::pair<size_t, element_s> >
+   satisfyingLeafs(const std::vector<int>& attributes,
+                   element_s& currentCoeff,
+                   size_t firstLeaf,
+                   size_t& leafs);
+
 public:
    Node(const Node& other);
-   Node(Node&& other);
+   Node(Node&& other) noexcept;
    Node(int attr);
-   Node(Type type, const std::vector<Node>& children = { });
+   Node(Type type, std::vector<Node> children = { });
    
    Node& operator=(Node other);
    Node& operator=(Node&& other);
    
    void addChild(const Node& node);
    const std::vector<Node>& getChildren() const;
+   Type getType() const;
    
    //TODO: Abstract traversal order
    /**
@@ -68,6 +95,11 @@ public:
    std::vector<int> getLeafs() const;
    unsigned int getThreshold() const;
    unsigned int getPolyDegree() const;
+
+   /**
+    * @brief Formats the policy in the syntax accepted by parsePolicy.
+    */
+   std::string toString() const;
    
    /**
     * @brief Split the given secret share to the children of the given node.
@@ -103,30 +135,49 @@ public:
    std::vector< std::pair<int, element_s> >
    satisfyingAttributes(const std::vector<int>& attributes,
                         element_s& currentCoeff);
+
+   /**
+    * @brief Like satisfyingAttributes, but identifies the leafs by their position in
+    * getLeafs (offset by firstLeaf) instead of by attribute.
+    */
+   std::vector< std::pair<size_t, element_s> >
+   satisfyingLeafs(const std::vector<int>& attributes,
+                   element_s& currentCoeff,
+                   size_t firstLeaf = 0);
 };
 
 class DecryptionKey {
 
 public:
    Node accessPolicy;
-   std::map<int, element_s> Di;
+   // One share per leaf, in the order of accessPolicy.getLeafs(). An attribute that
+   // appears in several leafs has several shares.
+   std::vector<element_s> Di;
 
    DecryptionKey(const DecryptionKey& other) = default;
    DecryptionKey(const Node& policy);   
 };
 
 typedef struct {
+   element_s g;
    element_s pk;
    std::map<int, element_s> Pi;
 } PublicParams;
 
 typedef struct {
+   element_s g;
    element_s mk;
    std::map<int, element_s> Si;
 } PrivateParams;
 
 typedef std::map<int, element_s> Cw_t;
 
+/**
+ * @brief Checks every Ci with isInG1Subgroup. Call this on Cw read from untrusted input
+ * before decrypting with it.
+ */
+bool isValidCw(Cw_t& Cw);
+
 /**
  * @brief Generates the public and private parameters of the scheme.
  */
@@ -134,6 +185,55 @@ void setup(const std::vector<int>& attributes,
            PublicParams& publicParams,
            PrivateParams& privateParams);
 
+/**
+ * @brief Adds attributes to the universe of an existing setup.
+ *
+ * Only the new attributes get a fresh Si/Pi pair, so existing keys and ciphertexts stay
+ * valid. The exponentiations of large additions are spread over all hardware threads.
+ *
+ * @throws std::invalid_argument if an attribute is already part of the universe.
+ */
+void addAttributes(const std::vector<int>& attributes,
+                   PublicParams& publicParams,
+                   PrivateParams& privateParams);
+
+/**
+ * @brief Re-key tokens, si' / si for each rotated attribute.
+ *
+ * The elements are owned by the caller.
+ */
+typedef std::map<int, element_s> RekeyTokens;
+
+/**
+ * @brief Rotates the secrets of the given attributes.
+ *
+ * Draws a new si' for each attribute and updates Si and Pi = g^si'. The returned tokens
+ * move existing ciphertexts and keys to the new parameters without decrypting anything
+ * (see rekeyCiphertexts and rekeyKey). Keys that are not re-keyed can no longer use
+ * the rotated attributes on re-keyed or new ciphertexts, which revokes them.
+ *
+ * @throws std::invalid_argument if an attribute is not part of the universe (in either
+ * the public or the private parameters).
+ */
+RekeyTokens rotateAttributes(const std::vector<int>& attributes,
+                             PublicParams& publicParams,
+                             PrivateParams& privateParams);
+
+/**
+ * @brief Re-keys ciphertext components in place: Ci' = Ci ^ (si' / si).
+ *
+ * Only the components of rotated attributes change. Ciphertexts are processed in
+ * parallel; to stream over a large store, call this on consecutive batches.
+ */
+void rekeyCiphertexts(RekeyTokens& tokens, Cw_t* ciphertexts, size_t count);
+void rekeyCiphertexts(RekeyTokens& tokens, std::vector<Cw_t>& ciphertexts);
+
+/**
+ * @brief Re-keys a decryption key in place: Di' = Di / (si' / si) for every leaf of a
+ * rotated attribute.
+ */
+void rekeyKey(RekeyTokens& tokens, DecryptionKey& key);
+
 /**
  * @brief Creates a decryption key.
  *
@@ -151,6 +251,39 @@ Cw_t createSecret(PublicParams& params,
                  const std::vector<int>& attributes,
                  element_s& Cs);
 
+/**
+ * @brief The exponents Di * coeff(i) that recover a secret for one attribute set.
+ *
+ * There is one exponent per attribute: the terms of leafs that share an attribute are
+ * summed, so each attribute costs a single exponentiation of its Ci.
+ *
+ * A plan depends on the key and the attribute set only, not on the ciphertext, so it
+ * can be computed once and applied to every Cw with the same attributes.
+ */
+class DecryptionPlan {
+
+public:
+   std::vector< std::pair<int, element_s> > exponents;
+
+   DecryptionPlan() = default;
+   DecryptionPlan(const DecryptionPlan& other) = delete;
+   DecryptionPlan(DecryptionPlan&& other) = default;
+   DecryptionPlan& operator=(const DecryptionPlan& other) = delete;
+   ~DecryptionPlan();
+};
+
+/**
+ * @brief Evaluates the key's policy on the attributes.
+ *
+ * @throws UnsatError if the attributes do not satisfy the policy.
+ */
+DecryptionPlan planDecryption(DecryptionKey& key, const std::vector<int>& attributes);
+
+/**
+ * @brief Recovers a KP-ABE secret with a plan for the attributes of Cw.
+ */
+void applyDecryption(DecryptionPlan& plan, Cw_t& Cw, element_s& Cs);
+
 /**
  * @brief Recovers a KP-ABE secret using the decryption key and decryption parameters.
  */
@@ -181,5 +314,231 @@ std::string decrypt(DecryptionKey& key,
 
 class UnsatError: public std::exception { };
 
+/*
+ * Serialization.
+ *
+ * The serializers append a tagged, length-prefixed encoding to out. Group elements
+ * use PBC's canonical encoding, integers are little-endian. The deserializers
+ * initialize the given elements and return the number of bytes consumed.
+ *
+ * Deserializers throw std::invalid_argument on malformed input.
+ */
+void serializePublicParams(PublicParams& publicParams, std::vector<uint8_t>& out);
+size_t deserializePublicParams(const uint8_t* data, size_t len, PublicParams& publicParams);
+
+void serializePrivateParams(PrivateParams& privateParams, std::vector<uint8_t>& out);
+size_t deserializePrivateParams(const uint8_t* data, size_t len, PrivateParams& privateParams);
+
+/**
+ * Keys are written with one share per leaf.
+ */
+void serializeKey(DecryptionKey& key, std::vector<uint8_t>& out);
+size_t deserializeKey(const uint8_t* data, size_t len, DecryptionKey& key);
+
+void serializeCw(Cw_t& Cw, std::vector<uint8_t>& out);
+size_t deserializeCw(const uint8_t* data, size_t len, Cw_t& Cw);
+
+/**
+ * @brief An inverted index over the attribute sets of stored ciphertexts.
+ *
+ * Answers "which ciphertexts can this policy open?" with set operations on sorted
+ * posting lists only - no group operations and no coefficient recovery.
+ */
+class CiphertextIndex {
+
+public:
+   typedef size_t Id;
+
+private:
+   Id nextId = 0;
+   std::map<int, std::vector<Id>> postings;
+
+   std::vector<Id> candidates(const Node& policy) const;
+
+public:
+   /**
+    * @brief Adds a ciphertext with the given attribute set to the index.
+    *
+    * @return The id of the ciphertext. Ids are assigned in insertion order.
+    */
+   Id add(const std::vector<int>& attributes);
+   Id add(const Cw_t& Cw);
+
+   /**
+    * @brief Returns the number of ciphertexts added to the index.
+    */
+   size_t size() const;
+
+   /**
+    * @brief Returns the ids of all ciphertexts whose attributes satisfy the policy.
+    *
+    * The ids are sorted in ascending order.
+    */
+   std::vector<Id> query(const Node& policy) const;
+   std::vector<Id> query(const DecryptionKey& key) const;
+};
+
+class PolicyParseError: public std::runtime_error {
+public:
+   using std::runtime_error::runtime_error;
+};
+
+/**
+ * @brief An immutable node of an interned access policy.
+ *
+ * Terms are created and owned by a PolicyPool. Structurally identical subtrees are
+ * represented by the same term, so terms can be compared by address.
+ */
+class PolicyTerm {
+   friend class PolicyPool;
+
+public:
+   const Node::Type type;
+   const int attr;
+   const std::vector<const PolicyTerm*> children;
+
+private:
+   const size_t hash;
+   std::vector<int> leafs;
+
+   PolicyTerm(Node::Type type, int attr, std::vector<const PolicyTerm*> children, size_t hash);
+
+public:
+   bool isLeaf() const;
+   unsigned int getThreshold() const;
+
+   /**
+    * @brief Returns all leaf attributes under this term, left to right.
+    *
+    * Computed once when the term is interned.
+    */
+   const std::vector<int>& getLeafs() const;
+
+   /**
+    * @brief Expands the term into a (mutable, deep-copied) Node tree.
+    */
+   Node toNode() const;
+};
+
+/**
+ * @brief Owns interned policy terms and the data derived from them.
+ *
+ * Every subtree is stored once per pool, no matter how many policies contain it. The
+ * Lagrange coefficients of a gate are computed once per threshold, and the selection of
+ * leafs (and their coefficients) that satisfies a term is computed once per term and
+ * attribute set, so keys whose policies share subtrees share that work.
+ *
+ * A pool is not thread-safe; use one per thread or guard it externally.
+ */
+class PolicyPool {
+
+public:
+   typedef const PolicyTerm* Ref;
+
+   /**
+    * @brief The satisfying leafs of a term (positions in its getLeafs) and their
+    * coefficients. Empty if the term is not satisfied.
+    */
+   typedef std::vector< std::pair<size_t, element_s> > TermPlan;
+
+private:
+   struct TermKey {
+      Node::Type type;
+      int attr;
+      std::vector<Ref> children;
+
+      bool operator==(const TermKey& other) const;
+   };
+
+   struct TermKeyHash {
+      size_t operator()(const TermKey& key) const;
+   };
+
+   std::unordered_map<TermKey, std::unique_ptr<PolicyTerm>, TermKeyHash> terms;
+   std::map<unsigned int, std::vector<element_s>> coefficientCache;
+   std::map<std::vector<int>, size_t> attributeSets;
+   std::map<std::pair<Ref, size_t>, TermPlan> plans;
+   size_t evaluations = 0;
+
+   Ref intern(Node::Type type, int attr, std::vector<Ref> children);
+   const TermPlan& plan(Ref term, size_t setId, const std::vector<int>& attributeSet);
+   std::vector<element_s>& thresholdCoefficients(unsigned int threshold);
+
+public:
+   PolicyPool() = default;
+   PolicyPool(const PolicyPool& other) = delete;
+   PolicyPool& operator=(const PolicyPool& other) = delete;
+   ~PolicyPool();
+
+   Ref leaf(int attr);
+   Ref gate(Node::Type type, std::vector<Ref> children);
+
+   /**
+    * @brief Parses a policy such as "(1 OR 2) AND (3 OR 4)".
+    *
+    * Operands are integer attributes. AND binds tighter than OR and the keywords are
+    * case-insensitive. A chain of the same operator becomes a single gate, e.g.
+    * "1 OR 2 OR 3" is one OR gate with three children. Parentheses nest at most 64 deep.
+    *
+    * @throws PolicyParseError if the string is not a valid policy.
+    */
+   Ref parse(const std::string& policy);
+
+   /**
+    * @brief Returns the Lagrange coefficients for the children of the given gate.
+    *
+    * The elements are owned by the pool.
+    */
+   const std::vector<element_s>& coefficients(Ref term);
+
+   /**
+    * @brief Returns the leafs of the term that recover its secret for the attributes.
+    *
+    * Plans are cached per term and attribute set, and a term's plan is built from the
+    * cached plans of its children. The elements are owned by the pool.
+    */
+   const TermPlan& plan(Ref term, const std::vector<int>& attributes);
+
+   /**
+    * @brief Returns how many term plans have been computed (not served from the cache).
+    */
+   size_t planEvaluations() const;
+
+   /**
+    * @brief Returns the number of unique terms in the pool.
+    */
+   size_t size() const;
+};
+
+/**
+ * @brief Creates a decryption key for an interned policy.
+ *
+ * The shares are split along the terms and the leaf list of the term is reused. The
+ * key's accessPolicy is the expanded tree, so it serializes like any other key.
+ *
+ * @throws std::invalid_argument if a leaf attribute is not part of the universe.
+ */
+DecryptionKey keyGeneration(PrivateParams& privateParams, PolicyPool::Ref policy);
+
+/**
+ * @brief Like planDecryption, with the leaf selection taken from the pool's plan cache.
+ *
+ * The key must have been generated for the policy.
+ *
+ * @throws std::invalid_argument if the key has a different number of shares.
+ * @throws UnsatError if the attributes do not satisfy the policy.
+ */
+DecryptionPlan planDecryption(DecryptionKey& key,
+                              PolicyPool& pool,
+                              PolicyPool::Ref policy,
+                              const std::vector<int>& attributes);
+
+/**
+ * @brief Parses a policy string directly into a Node tree, without interning.
+ *
+ * @see PolicyPool::parse for the syntax.
+ */
+Node parsePolicy(const std::string& policy);
+
 #pragma GCC visibility pop
 #endif
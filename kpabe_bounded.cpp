@@ -0,0 +1,496 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <mbedtls/aes.h>
+#include <pbc.h>
+
+#include "kpabe.hpp"
+#include "kpabe_bounded.hpp"
+
+using namespace std;
+
+static const size_t AES_BLOCK_SIZE = 16;
+static const size_t AES_KEY_SIZE = 32;
+
+// Scratch buffer for measuring the scratch costs, and the headroom added to them.
+static const size_t CALIBRATION_SCRATCH = 64 * 1024;
+static const size_t HEADROOM_DIVISOR = 4;
+
+// Scratch arena
+
+static const size_t ARENA_ALIGN = 16;
+static const size_t NO_BLOCK = SIZE_MAX;
+
+/**
+ * Precedes every arena block, keeps the payload 16-byte aligned.
+ */
+struct BlockHeader {
+   size_t size;     // Requested size, the top bit marks a freed block.
+   size_t previous; // Offset of the previous block's header, or NO_BLOCK.
+};
+
+static const size_t FREED = ~(SIZE_MAX >> 1);
+
+/**
+ * A stack allocator over the scratch buffer. Freed blocks are reclaimed once every block
+ * above them has been freed too. Allocations that do not fit go to the heap and are
+ * counted.
+ */
+struct Arena {
+   uint8_t* base;
+   size_t size;
+   size_t top;
+   size_t last; // Offset of the topmost block's header.
+   size_t peak;
+   size_t overflowBytes;
+};
+
+// The arena of the bounded call running on this thread, if any.
+static thread_local Arena* arena = nullptr;
+
+static size_t alignUp(size_t n) {
+   return (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static bool inArena(const Arena& a, const void* p) {
+   auto bytes = static_cast<const uint8_t*>(p);
+   return bytes >= a.base && bytes < a.base + a.size;
+}
+
+static BlockHeader& header(void* p) {
+   return *reinterpret_cast<BlockHeader*>(static_cast<uint8_t*>(p) - sizeof(BlockHeader));
+}
+
+static BlockHeader& headerAt(Arena& a, size_t offset) {
+   return *reinterpret_cast<BlockHeader*>(a.base + offset);
+}
+
+static size_t headerOffset(const Arena& a, void* p) {
+   return static_cast<uint8_t*>(p) - sizeof(BlockHeader) - a.base;
+}
+
+/**
+ * Allocates from the arena, or from the fallback if the block does not fit.
+ */
+static void* arenaAlloc(Arena& a, size_t n, void* (*fallback)(size_t)) {
+   const size_t need = sizeof(BlockHeader) + alignUp(n);
+   if(a.size - a.top < need) {
+      a.overflowBytes += n;
+      return fallback(n);
+   }
+   BlockHeader& block = headerAt(a, a.top);
+   block.size = n;
+   block.previous = a.last;
+   a.last = a.top;
+   a.top += need;
+   a.peak = max(a.peak, a.top);
+   return &block + 1;
+}
+
+static void arenaFree(Arena& a, void* p) {
+   header(p).size |= FREED;
+   while(a.last != NO_BLOCK && (headerAt(a, a.last).size & FREED)) {
+      a.top = a.last;
+      a.last = headerAt(a, a.last).previous;
+   }
+}
+
+static void* arenaRealloc(Arena& a, void* p, size_t n, void* (*fallback)(size_t)) {
+   const size_t oldSize = header(p).size;
+   const size_t offset = headerOffset(a, p);
+   if(offset == a.last && a.size - offset - sizeof(BlockHeader) >= alignUp(n)) {
+      // The topmost block can grow or shrink in place.
+      header(p).size = n;
+      a.top = offset + sizeof(BlockHeader) + alignUp(n);
+      a.peak = max(a.peak, a.top);
+      return p;
+   }
+   if(n <= oldSize) {
+      return p;
+   }
+
+   void* moved = arenaAlloc(a, n, fallback);
+   memcpy(moved, p, oldSize);
+   arenaFree(a, p);
+   return moved;
+}
+
+// Allocator hooks. PBC and GMP only take process-wide memory functions, so these are
+// installed once at startup and forward everything that is not made by a bounded call on
+// the calling thread to the functions that were installed before.
+
+static struct {
+   void* (*gmpAlloc)(size_t);
+   void* (*gmpRealloc)(void*, size_t, size_t);
+   void (*gmpFree)(void*, size_t);
+   void* (*pbcMalloc)(size_t);
+   void* (*pbcRealloc)(void*, size_t);
+   void (*pbcFree)(void*);
+} previous;
+
+static void* gmpAlloc(size_t n) {
+   return arena ? arenaAlloc(*arena, n, previous.gmpAlloc) : previous.gmpAlloc(n);
+}
+
+static void* gmpRealloc(void* p, size_t oldSize, size_t n) {
+   if(arena && inArena(*arena, p)) {
+      return arenaRealloc(*arena, p, n, previous.gmpAlloc);
+   }
+   return previous.gmpRealloc(p, oldSize, n);
+}
+
+static void gmpFree(void* p, size_t size) {
+   if(arena && inArena(*arena, p)) {
+      arenaFree(*arena, p);
+   } else {
+      previous.gmpFree(p, size);
+   }
+}
+
+static void* pbcMalloc(size_t n) {
+   return arena ? arenaAlloc(*arena, n, previous.pbcMalloc) : previous.pbcMalloc(n);
+}
+
+static void* pbcRealloc(void* p, size_t n) {
+   if(arena && !p) {
+      return arenaAlloc(*arena, n, previous.pbcMalloc);
+   }
+   if(arena && inArena(*arena, p)) {
+      return arenaRealloc(*arena, p, n, previous.pbcMalloc);
+   }
+   return previous.pbcRealloc(p, n);
+}
+
+static void pbcFree(void* p) {
+   if(arena && p && inArena(*arena, p)) {
+      arenaFree(*arena, p);
+   } else if(p) {
+      previous.pbcFree(p);
+   }
+}
+
+static bool installHooks() {
+   mp_get_memory_functions(&previous.gmpAlloc, &previous.gmpRealloc, &previous.gmpFree);
+   previous.pbcMalloc = pbc_malloc;
+   previous.pbcRealloc = pbc_realloc;
+   previous.pbcFree = pbc_free;
+   mp_set_memory_functions(gmpAlloc, gmpRealloc, gmpFree);
+   pbc_set_memory_functions(pbcMalloc, pbcRealloc, pbcFree);
+   return true;
+}
+
+// Swapping the hooks in and out per call would race with allocations on other threads.
+static const bool hooksInstalled = installHooks();
+
+/**
+ * Routes the PBC and GMP allocations of this thread to the scratch buffer for its
+ * lifetime.
+ */
+class ScratchScope {
+   Arena state;
+
+public:
+   ScratchScope(uint8_t* scratch, size_t scratchSize) {
+      // Align the start of the buffer, the arena hands out 16-byte aligned blocks.
+      const size_t skew = (ARENA_ALIGN - reinterpret_cast<uintptr_t>(scratch) % ARENA_ALIGN) %
+                          ARENA_ALIGN;
+      state.base = scratch + min(skew, scratchSize);
+      state.size = scratchSize - min(skew, scratchSize);
+      state.top = 0;
+      state.last = NO_BLOCK;
+      state.peak = 0;
+      state.overflowBytes = 0;
+      arena = &state;
+   }
+
+   ~ScratchScope() {
+      arena = nullptr;
+   }
+
+   const Arena& usage() const {
+      return state;
+   }
+};
+
+// Policy evaluation without containers
+
+static bool isSatisfied(const Node& node, const vector<int>& attributes) {
+   const auto& children = node.getChildren();
+   if(children.empty()) {
+      return find(attributes.begin(), attributes.end(), node.attr) != attributes.end();
+   }
+   if(node.getType() == Node::Type::AND) {
+      for(const Node& child: children) {
+         if(!isSatisfied(child, attributes)) {
+            return false;
+         }
+      }
+      return true;
+   }
+   for(const Node& child: children) {
+      if(isSatisfied(child, attributes)) {
+         return true;
+      }
+   }
+   return false;
+}
+
+struct Accumulator {
+   DecryptionKey& key;
+   Cw_t& Cw;
+   element_t Cs;
+   element_t Zy;
+   element_t exponent;
+   bool pastFirst = false;
+   bool missing = false;
+
+   Accumulator(DecryptionKey& key, Cw_t& Cw): key(key), Cw(Cw) {
+      element_init_G1(Cs, getPairing());
+      element_init_G1(Zy, getPairing());
+      element_init_Zr(exponent, getPairing());
+   }
+
+   ~Accumulator() {
+      element_clear(Cs);
+      element_clear(Zy);
+      element_clear(exponent);
+   }
+};
+
+static size_t leafCount(const Node& node) {
+   size_t count = node.getChildren().empty() ? 1 : 0;
+   for(const Node& child: node.getChildren()) {
+      count += leafCount(child);
+   }
+   return count;
+}
+
+/**
+ * Cs *= Ci ^ (Di * coeff(i)) over the same leafs that satisfyingLeafs selects, where
+ * firstLeaf is the position of the node's first leaf. Assumes that node is satisfied.
+ *
+ * Unlike planDecryption, leafs that share an attribute are not combined: that would
+ * need storage per attribute.
+ */
+static void accumulate(const Node& node, const vector<int>& attributes,
+                       element_s& coeff, size_t firstLeaf, Accumulator& acc) {
+   const auto& children = node.getChildren();
+   if(children.empty()) {
+      auto attrCiIter = acc.Cw.find(node.attr);
+      if(firstLeaf >= acc.key.Di.size() || attrCiIter == acc.Cw.end()) {
+         acc.missing = true;
+         return;
+      }
+      element_mul(acc.exponent, &acc.key.Di[firstLeaf], &coeff);
+      powG1(acc.Zy, &attrCiIter->second, acc.exponent);
+      if(acc.pastFirst) {
+         element_mul(acc.Cs, acc.Cs, acc.Zy);
+      } else {
+         acc.pastFirst = true;
+         element_set(acc.Cs, acc.Zy);
+      }
+      return;
+   }
+
+   if(node.getType() == Node::Type::OR) {
+      // An OR has threshold 1, its coefficient is 1.
+      for(const Node& child: children) {
+         if(isSatisfied(child, attributes)) {
+            accumulate(child, attributes, coeff, firstLeaf, acc);
+            return;
+         }
+         firstLeaf += leafCount(child);
+      }
+      return;
+   }
+
+   // The Lagrange coefficient of child i of an n-of-n gate is (-1)^(i + 1) * C(n, i).
+   const long n = static_cast<long>(children.size());
+   element_t binomial, childCoeff;
+   element_init_Zr(binomial, getPairing());
+   element_init_Zr(childCoeff, getPairing());
+   element_set1(binomial);
+   for(long i = 1; i <= n; ++i) {
+      element_mul_si(binomial, binomial, n - i + 1);
+      element_set_si(childCoeff, i);
+      element_div(binomial, binomial, childCoeff);
+
+      element_mul(childCoeff, &coeff, binomial);
+      if(i % 2 == 0) {
+         element_neg(childCoeff, childCoeff);
+      }
+      accumulate(children[i - 1], attributes, *childCoeff, firstLeaf, acc);
+      firstLeaf += leafCount(children[i - 1]);
+   }
+   element_clear(binomial);
+   element_clear(childCoeff);
+}
+
+static size_t policyDepth(const Node& node) {
+   size_t depth = 0;
+   for(const Node& child: node.getChildren()) {
+      depth = max(depth, policyDepth(child));
+   }
+   return node.getChildren().empty() ? 0 : depth + 1;
+}
+
+/**
+ * Scratch taken by one G1 or Zr element, and by the temporaries of the costliest call
+ * that a bounded decryption makes (powG1, hashElement or the coefficient arithmetic of
+ * an AND gate) on top of its live elements.
+ */
+struct ScratchCosts {
+   size_t element;
+   size_t call;
+};
+
+/**
+ * Measures the scratch costs by running the operations of a bounded decryption in a
+ * scratch buffer, so that they match the PBC and GMP builds in use.
+ */
+static ScratchCosts measureScratchCosts() {
+   // Random values are drawn on the heap, drawing them needs temporaries.
+   element_t randomG1, randomZr;
+   element_init_G1(randomG1, getPairing());
+   element_init_Zr(randomZr, getPairing());
+   element_random(randomG1);
+   element_random(randomZr);
+
+   vector<uint8_t> scratch(CALIBRATION_SCRATCH);
+   ScratchCosts costs;
+   {
+      ScratchScope scope(scratch.data(), scratch.size());
+      element_t base, exponent, result;
+      element_init_G1(base, getPairing());
+      element_set(base, randomG1);
+      const size_t g1Size = scope.usage().top;
+      element_init_Zr(exponent, getPairing());
+      element_set(exponent, randomZr);
+      const size_t zrSize = scope.usage().top - g1Size;
+      element_init_G1(result, getPairing());
+      element_t binomial, childCoeff;
+      element_init_Zr(binomial, getPairing());
+      element_init_Zr(childCoeff, getPairing());
+      const size_t live = scope.usage().top;
+
+      // The calls of accumulate().
+      element_set(binomial, randomZr);
+      element_mul_si(binomial, binomial, 3);
+      element_set_si(childCoeff, 2);
+      element_div(binomial, binomial, childCoeff);
+      element_neg(childCoeff, binomial);
+      element_mul(exponent, exponent, childCoeff);
+      powG1(result, base, exponent);
+      uint8_t fileKey[AES_KEY_SIZE];
+      hashElement(result, fileKey);
+      costs.element = max(g1Size, zrSize);
+      costs.call = scope.usage().peak - live;
+
+      element_clear(base);
+      element_clear(exponent);
+      element_clear(result);
+      element_clear(binomial);
+      element_clear(childCoeff);
+      if(scope.usage().overflowBytes) {
+         throw logic_error("Calibration scratch too small");
+      }
+   }
+   element_clear(randomG1);
+   element_clear(randomZr);
+   costs.element += costs.element / HEADROOM_DIVISOR;
+   costs.call += costs.call / HEADROOM_DIVISOR;
+   return costs;
+}
+
+size_t boundedScratchSize(const Node& policy) {
+   static const ScratchCosts costs = measureScratchCosts();
+   // Cs, Zy, exponent and the root coefficient, plus two coefficients per gate level.
+   return costs.call + (4 + 2 * policyDepth(policy)) * costs.element;
+}
+
+bool recoverKeyBounded(DecryptionKey& key,
+                       Cw_t& Cw,
+                       const vector<int>& attributes,
+                       uint8_t* scratch, size_t scratchSize,
+                       uint8_t* fileKey,
+                       ScratchUsage* usage) {
+   if(!isSatisfied(key.accessPolicy, attributes)) {
+      return false;
+   }
+
+   // Initialize the pairing (which allocates) before switching allocators.
+   getPairing();
+
+   bool missing;
+   size_t overflowBytes;
+   {
+      ScratchScope scope(scratch, scratchSize);
+      {
+         Accumulator acc(key, Cw);
+         element_t rootCoeff;
+         element_init_Zr(rootCoeff, getPairing());
+         element_set1(rootCoeff);
+         accumulate(key.accessPolicy, attributes, *rootCoeff, 0, acc);
+         element_clear(rootCoeff);
+
+         missing = acc.missing;
+         if(!missing) {
+            hashElement(acc.Cs, fileKey);
+         }
+      }
+      overflowBytes = scope.usage().overflowBytes;
+      if(usage) {
+         usage->peak = scope.usage().peak;
+         usage->overflowBytes = overflowBytes;
+      }
+   }
+
+   if(overflowBytes) {
+      memset(fileKey, 0, AES_KEY_SIZE);
+      throw ScratchOverflowError("Scratch buffer too small by at least " +
+                                 to_string(overflowBytes) + " bytes");
+   }
+   return !missing;
+}
+
+size_t decryptBounded(DecryptionKey& key,
+                      Cw_t& Cw,
+                      const vector<int>& attributes,
+                      const uint8_t* ciphertext, size_t ciphertextLen,
+                      uint8_t* plaintext,
+                      uint8_t* scratch, size_t scratchSize,
+                      ScratchUsage* usage) {
+   if(ciphertextLen == 0 || ciphertextLen % AES_BLOCK_SIZE) {
+      throw invalid_argument("Ciphertext is not a whole number of blocks");
+   }
+
+   uint8_t fileKey[AES_KEY_SIZE];
+   if(!recoverKeyBounded(key, Cw, attributes, scratch, scratchSize, fileKey, usage)) {
+      throw UnsatError();
+   }
+
+   // AES-256-CBC with a zero IV and PKCS#7 padding, as in encrypt().
+   mbedtls_aes_context aes;
+   mbedtls_aes_init(&aes);
+   mbedtls_aes_setkey_dec(&aes, fileKey, AES_KEY_SIZE * 8);
+   uint8_t iv[AES_BLOCK_SIZE] = { 0 };
+   mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_DECRYPT, ciphertextLen, iv, ciphertext, plaintext);
+   mbedtls_aes_free(&aes);
+   memset(fileKey, 0, sizeof(fileKey));
+
+   const uint8_t padding = plaintext[ciphertextLen - 1];
+   if(padding == 0 || padding > AES_BLOCK_SIZE) {
+      throw invalid_argument("Invalid padding");
+   }
+   for(size_t i = ciphertextLen - padding; i < ciphertextLen; ++i) {
+      if(plaintext[i] != padding) {
+         throw invalid_argument("Invalid padding");
+      }
+   }
+   return ciphertextLen - padding;
+}
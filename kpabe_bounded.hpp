@@ -0,0 +1,86 @@
+#ifndef kpabe_bounded_
+#define kpabe_bounded_
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "kpabe.hpp"
+
+#pragma GCC visibility push(default)
+
+/*
+ * Bounded-memory decryption for embedded targets.
+ *
+ * While a bounded call runs, PBC and GMP allocate from a caller-supplied scratch buffer
+ * (through pbc_set_memory_functions and mp_set_memory_functions) and the policy is
+ * evaluated without building any containers. The scratch buffer needed for a policy is
+ * computed up front with boundedScratchSize.
+ *
+ * The memory functions of PBC and GMP are process-wide. When the library is loaded, they
+ * are replaced by hooks that serve the calling thread's bounded call from its scratch
+ * buffer and forward all other allocations to the functions that were installed before,
+ * so other threads can keep using PBC and GMP and bounded calls can run concurrently. The
+ * application must not change the PBC or GMP memory functions after that.
+ */
+
+/**
+ * @brief Scratch usage of the last bounded call.
+ */
+struct ScratchUsage {
+   size_t peak = 0;          // Highest scratch offset in use.
+   size_t overflowBytes = 0; // Bytes that did not fit and went to the heap.
+};
+
+/**
+ * @brief Thrown when the scratch buffer was too small.
+ *
+ * The call still completes (using the heap for the excess) so that no memory leaks,
+ * but its result is discarded.
+ */
+class ScratchOverflowError: public std::runtime_error {
+public:
+   using std::runtime_error::runtime_error;
+};
+
+/**
+ * @brief Returns the scratch size that the bounded calls need for the given policy.
+ *
+ * The scratch taken by an element and by a single PBC call is measured on the first
+ * call, with a quarter added as headroom.
+ */
+size_t boundedScratchSize(const Node& policy);
+
+/**
+ * @brief Recovers the file key (SHA-256 of the secret, as used by encrypt/decrypt).
+ *
+ * @return false if the attributes do not satisfy the policy.
+ * @throws ScratchOverflowError if the scratch buffer was too small.
+ */
+bool recoverKeyBounded(DecryptionKey& key,
+                       Cw_t& Cw,
+                       const std::vector<int>& attributes,
+                       uint8_t* scratch, size_t scratchSize,
+                       uint8_t* fileKey,
+                       ScratchUsage* usage = nullptr);
+
+/**
+ * @brief Decrypts a ciphertext produced by encrypt() into a caller-supplied buffer.
+ *
+ * @param plaintext Must hold at least ciphertextLen bytes.
+ * @return The plaintext length, including the terminating zero that encrypt() adds.
+ * @throws UnsatError if the attributes do not satisfy the policy.
+ * @throws std::invalid_argument if the ciphertext is malformed.
+ * @throws ScratchOverflowError if the scratch buffer was too small.
+ */
+size_t decryptBounded(DecryptionKey& key,
+                      Cw_t& Cw,
+                      const std::vector<int>& attributes,
+                      const uint8_t* ciphertext, size_t ciphertextLen,
+                      uint8_t* plaintext,
+                      uint8_t* scratch, size_t scratchSize,
+                      ScratchUsage* usage = nullptr);
+
+#pragma GCC visibility pop
+#endif
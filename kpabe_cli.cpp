@@ -0,0 +1,621 @@
+/*
+ * kpabe - bulk KP-ABE file encryption.
+ *
+ *    kpabe setup <attributes> <public-params> <private-params>
+ *    kpabe keygen <private-params> <policy> <key>
+ *    kpabe encrypt [-j threads] <public-params> <attributes> <input> <output>
+ *    kpabe decrypt [-j threads] <key> <input> <output>
+ *
+ * Attributes are given as a list such as "1,2,10-20". Inputs can be files or
+ * directories; directories are processed recursively and mirrored in the output.
+ *
+ * Every file gets its own KP-ABE secret. The file key is SHA-256 of the secret and the
+ * payload is AES-256-CTR encrypted, so large files are split into chunks that are
+ * processed in parallel. As with encrypt()/decrypt(), there is no MAC.
+ *
+ * Encrypted file layout:
+ *    "KPABEF1\0" | u32 header length | serialized Cw | u64 plaintext size | payload
+ */
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <mbedtls/aes.h>
+#include <pbc.h>
+
+#include "kpabe.hpp"
+#include "kpabe_tool.hpp"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+static const char FILE_MAGIC[8] = {'K', 'P', 'A', 'B', 'E', 'F', '1', '\0'};
+static const string ENCRYPTED_SUFFIX = ".kpabe";
+static const size_t CHUNK_SIZE = 8 << 20; // Must be a multiple of the AES block size.
+static const size_t AES_KEY_SIZE = 32;
+
+class CliError: public runtime_error {
+public:
+   using runtime_error::runtime_error;
+};
+
+// Helpers
+
+static void writeFile(const string& path, const vector<uint8_t>& data, mode_t mode) {
+   const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+   if(fd < 0) {
+      throw CliError("Cannot create " + path + ": " + strerror(errno));
+   }
+   size_t written = 0;
+   while(written < data.size()) {
+      const ssize_t n = write(fd, data.data() + written, data.size() - written);
+      if(n < 0) {
+         close(fd);
+         throw CliError("Cannot write " + path + ": " + strerror(errno));
+      }
+      written += n;
+   }
+   close(fd);
+}
+
+static bool isDirectory(const string& path) {
+   struct stat st;
+   return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static bool isSymlink(const string& path) {
+   struct stat st;
+   return lstat(path.c_str(), &st) == 0 && S_ISLNK(st.st_mode);
+}
+
+static void makeDirectories(const string& path) {
+   size_t pos = 0;
+   do {
+      pos = path.find('/', pos + 1);
+      const string prefix = path.substr(0, pos);
+      if(mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+         throw CliError("Cannot create directory " + prefix + ": " + strerror(errno));
+      }
+   } while(pos != string::npos);
+}
+
+static void clearElements(map<int, element_s>& elements) {
+   for(auto& attrElementPair: elements) {
+      element_clear(&attrElementPair.second);
+   }
+   elements.clear();
+}
+
+/**
+ * AES-256-CTR over data at the given offset of the stream (a multiple of 16).
+ */
+static void ctrCrypt(const uint8_t* key, uint64_t offset,
+                     const uint8_t* input, uint8_t* output, size_t len) {
+   mbedtls_aes_context aes;
+   mbedtls_aes_init(&aes);
+   mbedtls_aes_setkey_enc(&aes, key, AES_KEY_SIZE * 8);
+
+   uint8_t counter[16] = { 0 };
+   uint64_t block = offset / 16;
+   for(int i = 15; i >= 8; --i, block >>= 8) {
+      counter[i] = static_cast<uint8_t>(block);
+   }
+   uint8_t streamBlock[16];
+   size_t streamOffset = 0;
+   mbedtls_aes_crypt_ctr(&aes, len, &streamOffset, counter, streamBlock, input, output);
+   mbedtls_aes_free(&aes);
+}
+
+// Work scheduling
+
+/**
+ * A fixed pool of workers over a LIFO-biased task queue: follow-up tasks of a file
+ * are pushed to the front, so files in flight finish before new ones are opened.
+ */
+class TaskPool {
+   mutex lock;
+   condition_variable available;
+   deque< function<void ()> > tasks;
+   size_t running = 0;
+   vector<thread> workers;
+
+   void work() {
+      unique_lock<mutex> guard(lock);
+      for(;;) {
+         available.wait(guard, [this] { return !tasks.empty() || running == 0; });
+         if(tasks.empty()) {
+            return;
+         }
+         auto task = move(tasks.front());
+         tasks.pop_front();
+         guard.unlock();
+         task();
+         guard.lock();
+         --running;
+         if(tasks.empty() && running == 0) {
+            available.notify_all();
+         }
+      }
+   }
+
+public:
+   void pushBack(function<void ()> task) {
+      lock_guard<mutex> guard(lock);
+      ++running;
+      tasks.push_back(move(task));
+      available.notify_one();
+   }
+
+   void pushFront(function<void ()> task) {
+      lock_guard<mutex> guard(lock);
+      ++running;
+      tasks.push_front(move(task));
+      available.notify_one();
+   }
+
+   // Runs until all tasks, including the ones they push, are done.
+   void run(size_t threadCount) {
+      for(size_t i = 0; i < threadCount; ++i) {
+         workers.emplace_back(&TaskPool::work, this);
+      }
+      for(auto& worker: workers) {
+         worker.join();
+      }
+      workers.clear();
+   }
+};
+
+struct FileResult {
+   string path;
+   uint64_t bytes = 0;
+   double latencyMs = 0;
+   string error;
+};
+
+/**
+ * A file being processed. The last chunk to finish unmaps the file and records the
+ * result.
+ */
+struct FileJob {
+   string inPath, outPath;
+   FileResult* result;
+   Clock::time_point start;
+
+   const uint8_t* input = nullptr;
+   size_t inputLen = 0;
+   uint8_t* output = nullptr;
+   size_t outputLen = 0;
+   int outFd = -1;
+
+   uint64_t payloadLen = 0;
+   const uint8_t* payloadIn = nullptr;
+   uint8_t* payloadOut = nullptr;
+   array<uint8_t, AES_KEY_SIZE> key;
+   atomic<size_t> remainingChunks {0};
+
+   ~FileJob() {
+      if(input) {
+         munmap(const_cast<uint8_t*>(input), inputLen);
+      }
+      // Writeback errors only surface through msync and fsync; munmap and close drop them.
+      if(output && result->error.empty() && msync(output, outputLen, MS_SYNC) != 0) {
+         fail(string("cannot write output: ") + strerror(errno));
+      }
+      if(output) {
+         munmap(output, outputLen);
+      }
+      if(outFd >= 0 && result->error.empty() && fsync(outFd) != 0) {
+         fail(string("cannot write output: ") + strerror(errno));
+      }
+      if(outFd >= 0) {
+         close(outFd);
+      }
+      key.fill(0);
+   }
+
+   void fail(const string& error) {
+      result->error = error;
+      unlink(outPath.c_str());
+   }
+
+   void finish() {
+      result->bytes = payloadLen;
+      result->latencyMs = chrono::duration<double, milli>(Clock::now() - start).count();
+   }
+};
+
+static void mapInput(FileJob& job) {
+   const int fd = open(job.inPath.c_str(), O_RDONLY);
+   if(fd < 0) {
+      throw CliError(string("cannot open: ") + strerror(errno));
+   }
+   struct stat st;
+   if(fstat(fd, &st) != 0) {
+      const int error = errno;
+      close(fd);
+      throw CliError(string("cannot stat: ") + strerror(error));
+   }
+   job.inputLen = st.st_size;
+   if(job.inputLen > 0) {
+      void* mapped = mmap(nullptr, job.inputLen, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(mapped == MAP_FAILED) {
+         close(fd);
+         throw CliError(string("cannot map: ") + strerror(errno));
+      }
+      madvise(mapped, job.inputLen, MADV_SEQUENTIAL);
+      job.input = static_cast<const uint8_t*>(mapped);
+   }
+   close(fd);
+}
+
+static void mapOutput(FileJob& job, size_t len) {
+   job.outFd = open(job.outPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if(job.outFd < 0) {
+      throw CliError(string("cannot create output: ") + strerror(errno));
+   }
+   // Reserve the blocks up front: stores into a sparse shared mapping raise SIGBUS when
+   // the disk fills up.
+   const int error = posix_fallocate(job.outFd, 0, len);
+   if(error != 0) {
+      unlink(job.outPath.c_str());
+      throw CliError(string("cannot allocate output: ") + strerror(error));
+   }
+   job.outputLen = len;
+   void* mapped = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, job.outFd, 0);
+   if(mapped == MAP_FAILED) {
+      const int error = errno;
+      unlink(job.outPath.c_str());
+      throw CliError(string("cannot map output: ") + strerror(error));
+   }
+   job.output = static_cast<uint8_t*>(mapped);
+}
+
+/**
+ * Splits the payload of a prepared job into chunk tasks.
+ */
+static void scheduleChunks(TaskPool& pool, shared_ptr<FileJob> job) {
+   if(job->payloadLen == 0) {
+      job->finish();
+      return;
+   }
+   const size_t chunks = (job->payloadLen + CHUNK_SIZE - 1) / CHUNK_SIZE;
+   job->remainingChunks = chunks;
+   for(size_t i = 0; i < chunks; ++i) {
+      pool.pushFront([job, i] {
+         const uint64_t offset = i * CHUNK_SIZE;
+         const size_t len = min<uint64_t>(CHUNK_SIZE, job->payloadLen - offset);
+         ctrCrypt(job->key.data(), offset, job->payloadIn + offset, job->payloadOut + offset, len);
+         if(--job->remainingChunks == 0) {
+            job->finish();
+         }
+      });
+   }
+}
+
+static void encryptFile(TaskPool& pool, shared_ptr<FileJob> job,
+                        PublicParams& pub, const vector<int>& attributes) {
+   mapInput(*job);
+
+   element_s Cs;
+   Cw_t Cw = createSecret(pub, attributes, Cs);
+   hashElement(&Cs, job->key.data());
+   element_clear(&Cs);
+
+   vector<uint8_t> header(FILE_MAGIC, FILE_MAGIC + sizeof(FILE_MAGIC));
+   header.resize(header.size() + 4);
+   serializeCw(Cw, header);
+   clearElements(Cw);
+   const uint32_t cwLen = static_cast<uint32_t>(header.size() - sizeof(FILE_MAGIC) - 4);
+   for(int i = 0; i < 4; ++i) {
+      header[sizeof(FILE_MAGIC) + i] = static_cast<uint8_t>(cwLen >> (8 * i));
+   }
+   job->payloadLen = job->inputLen;
+   for(int i = 0; i < 8; ++i) {
+      header.push_back(static_cast<uint8_t>(job->payloadLen >> (8 * i)));
+   }
+
+   mapOutput(*job, header.size() + job->payloadLen);
+   memcpy(job->output, header.data(), header.size());
+   job->payloadIn = job->input;
+   job->payloadOut = job->output + header.size();
+   scheduleChunks(pool, job);
+}
+
+static void decryptFile(TaskPool& pool, shared_ptr<FileJob> job, DecryptionKey& key) {
+   mapInput(*job);
+
+   const size_t prefixLen = sizeof(FILE_MAGIC) + 4;
+   if(job->inputLen < prefixLen || memcmp(job->input, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0) {
+      throw CliError("not a kpabe file");
+   }
+   uint32_t cwLen = 0;
+   for(int i = 0; i < 4; ++i) {
+      cwLen |= static_cast<uint32_t>(job->input[sizeof(FILE_MAGIC) + i]) << (8 * i);
+   }
+   if(job->inputLen - prefixLen < static_cast<uint64_t>(cwLen) + 8) {
+      throw CliError("truncated header");
+   }
+
+   Cw_t Cw;
+   try {
+      if(deserializeCw(job->input + prefixLen, cwLen, Cw) != cwLen) {
+         throw invalid_argument("Ciphertext header has trailing bytes");
+      }
+   } catch(const invalid_argument& e) {
+      clearElements(Cw);
+      throw CliError(string("bad header: ") + e.what());
+   }
+   // Points outside the order-r subgroup would leak the key's exponents through the
+   // decrypted output.
+   if(!isValidCw(Cw)) {
+      clearElements(Cw);
+      throw CliError("bad header: point outside the group");
+   }
+   vector<int> attributes;
+   for(auto& attrCiPair: Cw) {
+      attributes.push_back(attrCiPair.first);
+   }
+
+   element_s Cs;
+   try {
+      recoverSecret(key, Cw, attributes, Cs);
+   } catch(const UnsatError&) {
+      clearElements(Cw);
+      throw CliError("policy not satisfied");
+   }
+   hashElement(&Cs, job->key.data());
+   element_clear(&Cs);
+   clearElements(Cw);
+
+   const uint8_t* sizeBytes = job->input + prefixLen + cwLen;
+   for(int i = 0; i < 8; ++i) {
+      job->payloadLen |= static_cast<uint64_t>(sizeBytes[i]) << (8 * i);
+   }
+   const size_t headerLen = prefixLen + cwLen + 8;
+   if(job->inputLen - headerLen != job->payloadLen) {
+      throw CliError("truncated payload");
+   }
+
+   if(job->payloadLen == 0) {
+      // mmap cannot map empty files.
+      const int fd = open(job->outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if(fd < 0) {
+         throw CliError(string("cannot create output: ") + strerror(errno));
+      }
+      close(fd);
+   } else {
+      mapOutput(*job, job->payloadLen);
+   }
+   job->payloadIn = job->input + headerLen;
+   job->payloadOut = job->output;
+   scheduleChunks(pool, job);
+}
+
+/**
+ * Lists (input, output) file pairs, mirroring directories.
+ */
+static void collectFiles(const string& in, const string& out, bool encrypting,
+                         vector< pair<string, string> >& files) {
+   if(!isDirectory(in)) {
+      files.push_back({in, out});
+      return;
+   }
+   makeDirectories(out);
+   DIR* dir = opendir(in.c_str());
+   if(!dir) {
+      throw CliError("Cannot open directory " + in + ": " + strerror(errno));
+   }
+   vector<string> names;
+   while(auto entry = readdir(dir)) {
+      const string name = entry->d_name;
+      if(name != "." && name != "..") {
+         names.push_back(name);
+      }
+   }
+   closedir(dir);
+   sort(names.begin(), names.end());
+
+   for(auto& name: names) {
+      const string inPath = in + "/" + name;
+      string outName = name;
+      if(isSymlink(inPath) && isDirectory(inPath)) {
+         // Following these could loop forever.
+         continue;
+      } else if(isDirectory(inPath)) {
+         // Keep directory names as they are.
+      } else if(encrypting) {
+         outName += ENCRYPTED_SUFFIX;
+      } else if(outName.size() > ENCRYPTED_SUFFIX.size() &&
+                outName.compare(outName.size() - ENCRYPTED_SUFFIX.size(),
+                                ENCRYPTED_SUFFIX.size(), ENCRYPTED_SUFFIX) == 0) {
+         outName.resize(outName.size() - ENCRYPTED_SUFFIX.size());
+      } else {
+         continue;
+      }
+      collectFiles(inPath, out + "/" + outName, encrypting, files);
+   }
+}
+
+static int processFiles(const string& in, const string& out, size_t threads, bool encrypting,
+                        const function<void (TaskPool&, shared_ptr<FileJob>)>& process) {
+   vector< pair<string, string> > files;
+   collectFiles(in, out, encrypting, files);
+   vector<FileResult> results(files.size());
+
+   TaskPool pool;
+   const auto start = Clock::now();
+   for(size_t i = 0; i < files.size(); ++i) {
+      pool.pushBack([&, i] {
+         auto job = make_shared<FileJob>();
+         job->inPath = files[i].first;
+         job->outPath = files[i].second;
+         job->result = &results[i];
+         job->result->path = job->inPath;
+         job->start = Clock::now();
+         try {
+            process(pool, job);
+         } catch(const exception& e) {
+            job->result->error = e.what();
+         }
+      });
+   }
+   pool.run(threads);
+   const double seconds = chrono::duration<double>(Clock::now() - start).count();
+
+   uint64_t totalBytes = 0;
+   vector<double> latencies;
+   int failures = 0;
+   for(auto& result: results) {
+      if(!result.error.empty()) {
+         cerr << result.path << ": " << result.error << endl;
+         ++failures;
+         continue;
+      }
+      totalBytes += result.bytes;
+      latencies.push_back(result.latencyMs);
+      printf("%s\t%llu bytes\t%.2f ms\n", result.path.c_str(),
+             static_cast<unsigned long long>(result.bytes), result.latencyMs);
+   }
+
+   sort(latencies.begin(), latencies.end());
+   auto percentile = [&](double p) {
+      return latencies.empty() ? 0.0 : latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+   };
+   printf("%zu files, %d failed, %.1f MB in %.3f s: %.1f MB/s, "
+          "latency p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+          latencies.size(), failures, totalBytes / 1e6, seconds,
+          seconds > 0 ? totalBytes / 1e6 / seconds : 0.0,
+          percentile(0.5), percentile(0.99), latencies.empty() ? 0.0 : latencies.back());
+   return failures ? 1 : 0;
+}
+
+// Commands
+
+static int setupCommand(const vector<string>& args) {
+   if(args.size() != 3) {
+      throw CliError("usage: kpabe setup <attributes> <public-params> <private-params>");
+   }
+   PublicParams pub;
+   PrivateParams priv;
+   setup(parseAttributeList(args[0]), pub, priv);
+
+   vector<uint8_t> pubBytes, privBytes;
+   serializePublicParams(pub, pubBytes);
+   serializePrivateParams(priv, privBytes);
+   writeFile(args[1], pubBytes, 0644);
+   writeFile(args[2], privBytes, 0600);
+   return 0;
+}
+
+static int keygenCommand(const vector<string>& args) {
+   if(args.size() != 3) {
+      throw CliError("usage: kpabe keygen <private-params> <policy> <key>");
+   }
+   PrivateParams priv;
+   auto privBytes = readFile(args[0]);
+   deserializePrivateParams(privBytes.data(), privBytes.size(), priv);
+
+   Node policy = parsePolicy(args[1]);
+   for(auto attr: policy.getLeafs()) {
+      if(!priv.Si.count(attr)) {
+         throw CliError("Attribute " + to_string(attr) + " is not in the universe");
+      }
+   }
+   auto key = keyGeneration(priv, policy);
+
+   vector<uint8_t> keyBytes;
+   serializeKey(key, keyBytes);
+   writeFile(args[2], keyBytes, 0600);
+   return 0;
+}
+
+static int encryptCommand(const vector<string>& args, size_t threads) {
+   if(args.size() != 4) {
+      throw CliError("usage: kpabe encrypt [-j threads] <public-params> <attributes> <input> <output>");
+   }
+   PublicParams pub;
+   auto pubBytes = readFile(args[0]);
+   deserializePublicParams(pubBytes.data(), pubBytes.size(), pub);
+
+   auto attributes = parseAttributeList(args[1]);
+   for(auto attr: attributes) {
+      if(!pub.Pi.count(attr)) {
+         throw CliError("Attribute " + to_string(attr) + " is not in the universe");
+      }
+   }
+
+   return processFiles(args[2], args[3], threads, true,
+                       [&](TaskPool& pool, shared_ptr<FileJob> job) {
+      encryptFile(pool, job, pub, attributes);
+   });
+}
+
+static int decryptCommand(const vector<string>& args, size_t threads) {
+   if(args.size() != 3) {
+      throw CliError("usage: kpabe decrypt [-j threads] <key> <input> <output>");
+   }
+   DecryptionKey key(Node(0));
+   auto keyBytes = readFile(args[0]);
+   deserializeKey(keyBytes.data(), keyBytes.size(), key);
+
+   return processFiles(args[1], args[2], threads, false,
+                       [&](TaskPool& pool, shared_ptr<FileJob> job) {
+      decryptFile(pool, job, key);
+   });
+}
+
+int main(int argc, char** argv) {
+   vector<string> args(argv + 1, argv + argc);
+   if(args.empty()) {
+      cerr << "usage: kpabe setup|keygen|encrypt|decrypt ..." << endl;
+      return 2;
+   }
+   const string command = args[0];
+   args.erase(args.begin());
+
+   size_t threads = max(1u, thread::hardware_concurrency());
+   if(args.size() >= 2 && args[0] == "-j") {
+      threads = max(1, atoi(args[1].c_str()));
+      args.erase(args.begin(), args.begin() + 2);
+   }
+
+   // Initialize the pairing before any worker thread uses it.
+   getPairing();
+
+   try {
+      if(command == "setup") {
+         return setupCommand(args);
+      } else if(command == "keygen") {
+         return keygenCommand(args);
+      } else if(command == "encrypt") {
+         return encryptCommand(args, threads);
+      } else if(command == "decrypt") {
+         return decryptCommand(args, threads);
+      }
+      cerr << "Unknown command: " << command << endl;
+      return 2;
+   } catch(const exception& e) {
+      cerr << e.what() << endl;
+      return 1;
+   }
+}
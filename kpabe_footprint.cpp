@@ -0,0 +1,197 @@
+/*
+ * kpabe_footprint - measures the memory footprint of bounded decryption (Linux).
+ *
+ *    kpabe_footprint [policy]...
+ *
+ * For every policy (a default set of shapes if none are given) this creates a key and a
+ * ciphertext satisfying all of its leafs, and runs recoverKeyBounded on a thread with a
+ * painted stack. Reports the scratch size computed by boundedScratchSize, the scratch
+ * actually used, the heap used during the call (scratch overflow and operator new) and
+ * the peak stack depth.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <pbc.h>
+
+#include "kpabe.hpp"
+#include "kpabe_bounded.hpp"
+
+using namespace std;
+
+static const size_t STACK_SIZE = 1 << 20;
+static const uint8_t STACK_PAINT = 0xa5;
+static const size_t LARGE_SCRATCH = 1 << 20;
+
+// operator new accounting, only while counting is set.
+
+static bool counting = false;
+static size_t newCalls = 0;
+static size_t newBytes = 0;
+static size_t newPeak = 0;
+
+void* operator new(size_t n) {
+   // Keep the size in front of the block so that delete can account for it.
+   auto block = static_cast<size_t*>(malloc(n + 16));
+   if(!block) {
+      throw bad_alloc();
+   }
+   block[0] = n;
+   if(counting) {
+      ++newCalls;
+      newBytes += n;
+      newPeak = max(newPeak, newBytes);
+   }
+   return reinterpret_cast<uint8_t*>(block) + 16;
+}
+
+void operator delete(void* p) noexcept {
+   if(!p) {
+      return;
+   }
+   auto block = reinterpret_cast<size_t*>(static_cast<uint8_t*>(p) - 16);
+   if(counting) {
+      newBytes -= min(newBytes, block[0]);
+   }
+   free(block);
+}
+
+void operator delete(void* p, size_t) noexcept {
+   operator delete(p);
+}
+
+struct Run {
+   DecryptionKey* key;
+   Cw_t* Cw;
+   vector<int>* attributes;
+   vector<uint8_t>* scratch;
+   ScratchUsage usage;
+   bool ok;
+   bool overflow;
+   const uint8_t* entry; // Stack address at the start of the thread function.
+};
+
+static void* runBounded(void* arg) {
+   Run& run = *static_cast<Run*>(arg);
+   volatile uint8_t marker = 0;
+   run.entry = const_cast<const uint8_t*>(&marker);
+   uint8_t fileKey[32];
+   counting = true;
+   try {
+      run.ok = recoverKeyBounded(*run.key, *run.Cw, *run.attributes,
+                                 run.scratch->data(), run.scratch->size(), fileKey, &run.usage);
+   } catch(const ScratchOverflowError&) {
+      run.overflow = true;
+   }
+   counting = false;
+   return nullptr;
+}
+
+/**
+ * Runs recoverKeyBounded on a fresh thread and returns the stack bytes it touched below
+ * the thread function's frame. Thread startup, the thread control block and the static
+ * TLS live above that frame at the top of the mapping and are not counted.
+ */
+static size_t measureStack(Run& run) {
+   void* stack = mmap(nullptr, STACK_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(stack == MAP_FAILED) {
+      return 0;
+   }
+   memset(stack, STACK_PAINT, STACK_SIZE);
+
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setstack(&attr, stack, STACK_SIZE);
+   pthread_t thread;
+   pthread_create(&thread, &attr, runBounded, &run);
+   pthread_join(thread, nullptr);
+   pthread_attr_destroy(&attr);
+
+   // The stack grows down; find the lowest byte that was written.
+   auto bytes = static_cast<const uint8_t*>(stack);
+   size_t untouched = 0;
+   while(untouched < STACK_SIZE && bytes[untouched] == STACK_PAINT) {
+      ++untouched;
+   }
+   const size_t used = run.entry > bytes + untouched ? run.entry - (bytes + untouched) : 0;
+   munmap(stack, STACK_SIZE);
+   return used;
+}
+
+static size_t depth(const Node& node) {
+   size_t childDepth = 0;
+   for(const Node& child: node.getChildren()) {
+      childDepth = max(childDepth, depth(child));
+   }
+   return node.getChildren().empty() ? 0 : childDepth + 1;
+}
+
+int main(int argc, char** argv) {
+   vector<string> policies(argv + 1, argv + argc);
+   if(policies.empty()) {
+      policies = {
+         "1",
+         "1 OR 2",
+         "1 AND 2",
+         "(1 OR 2) AND (3 OR 4)",
+         "1 AND 2 AND 3 AND 4 AND 5 AND 6 AND 7 AND 8",
+         "1 AND 2 AND 3 AND 4 AND 5 AND 6 AND 7 AND 8 AND 9 AND 10 AND 11 AND 12 AND 13 "
+            "AND 14 AND 15 AND 16 AND 17 AND 18 AND 19 AND 20 AND 21 AND 22 AND 23 AND 24 "
+            "AND 25 AND 26 AND 27 AND 28 AND 29 AND 30 AND 31 AND 32",
+         "((((((1 AND 2) AND 3) AND 4) AND 5) AND 6) AND 7) AND 8",
+         "((1 AND 2) OR (3 AND 4)) AND ((5 AND 6) OR (7 AND 8))",
+      };
+   }
+
+   printf("%-8s %-6s %-9s %-9s %-9s %-6s %-9s %s\n",
+          "leafs", "depth", "computed", "used", "overflow", "news", "new-peak", "stack");
+   for(const string& policyString: policies) {
+      Node policy = parsePolicy(policyString);
+      vector<int> attributes = policy.getLeafs();
+      sort(attributes.begin(), attributes.end());
+      attributes.erase(unique(attributes.begin(), attributes.end()), attributes.end());
+
+      PublicParams pub;
+      PrivateParams priv;
+      setup(attributes, pub, priv);
+      auto key = keyGeneration(priv, policy);
+      element_s Cs;
+      Cw_t Cw = createSecret(pub, attributes, Cs);
+
+      // Measure with plenty of scratch first, then check that the computed size suffices.
+      vector<uint8_t> scratch(LARGE_SCRATCH);
+      Run run {&key, &Cw, &attributes, &scratch, ScratchUsage(), false, false, nullptr};
+      newCalls = newBytes = newPeak = 0;
+      const size_t stack = measureStack(run);
+      const size_t calls = newCalls, callsPeak = newPeak;
+
+      const size_t computed = boundedScratchSize(policy);
+      vector<uint8_t> exact(computed);
+      Run check {&key, &Cw, &attributes, &exact, ScratchUsage(), false, false, nullptr};
+      measureStack(check);
+
+      printf("%-8zu %-6zu %-9zu %-9zu %-9zu %-6zu %-9zu %zu%s\n",
+             policy.getLeafs().size(), depth(policy), computed, run.usage.peak,
+             run.usage.overflowBytes, calls, callsPeak, stack,
+             run.ok && check.ok && !check.overflow ? "" : "   FAILED");
+
+      element_clear(&Cs);
+      for(auto& attrCiPair: Cw) {
+         element_clear(&attrCiPair.second);
+      }
+      for(auto& Di: key.Di) {
+         element_clear(&Di);
+      }
+   }
+   return 0;
+}
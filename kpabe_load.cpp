@@ -0,0 +1,168 @@
+/*
+ * kpabe_load - load generator for kpabed.
+ *
+ *    kpabe_load [-k key] [-c connections] [-n requests] [-u headers] \
+ *               <socket-path> <public-params> <attributes>
+ *
+ * Creates the given number of distinct ciphertext headers for the attributes (a list
+ * such as "1,3"), then sends requests for them over several connections, one request in
+ * flight per connection. Every returned file key is checked against the secret the
+ * header was created with. Reports throughput and the p50/p99 latency.
+ */
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <pbc.h>
+
+#include "kpabe.hpp"
+#include "kpabe_tool.hpp"
+#include "kpabed_protocol.hpp"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+struct Header {
+   vector<uint8_t> Cw;
+   array<uint8_t, kpabed::FILE_KEY_SIZE> fileKey;
+};
+
+static int connectTo(const string& socketPath) {
+   sockaddr_un address;
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+   const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+      if(fd >= 0) {
+         close(fd);
+      }
+      return -1;
+   }
+   return fd;
+}
+
+int main(int argc, char** argv) {
+   vector<string> args(argv + 1, argv + argc);
+   uint32_t keyIndex = 0;
+   size_t connections = 8, requests = 10000, headerCount = 64;
+   while(args.size() >= 2 && args[0].size() == 2 && args[0][0] == '-') {
+      const unsigned long value = strtoul(args[1].c_str(), nullptr, 10);
+      switch(args[0][1]) {
+         case 'k': keyIndex = static_cast<uint32_t>(value); break;
+         case 'c': connections = max(1ul, value); break;
+         case 'n': requests = value; break;
+         case 'u': headerCount = max(1ul, value); break;
+         default:
+            cerr << "Unknown option " << args[0] << endl;
+            return 2;
+      }
+      args.erase(args.begin(), args.begin() + 2);
+   }
+   if(args.size() != 3) {
+      cerr << "usage: kpabe_load [-k key] [-c connections] [-n requests] [-u headers] "
+              "<socket-path> <public-params> <attributes>" << endl;
+      return 2;
+   }
+   signal(SIGPIPE, SIG_IGN);
+
+   PublicParams pub;
+   vector<int> attributes;
+   try {
+      const auto data = readFile(args[1]);
+      deserializePublicParams(data.data(), data.size(), pub);
+      attributes = parseAttributeList(args[2]);
+   } catch(const exception& e) {
+      cerr << e.what() << endl;
+      return 1;
+   }
+   vector<Header> headers(headerCount);
+   for(auto& header: headers) {
+      element_s Cs;
+      Cw_t Cw = createSecret(pub, attributes, Cs);
+      serializeCw(Cw, header.Cw);
+      hashElement(&Cs, header.fileKey.data());
+      element_clear(&Cs);
+      for(auto& attrCiPair: Cw) {
+         element_clear(&attrCiPair.second);
+      }
+   }
+
+   atomic<size_t> nextRequest(0);
+   atomic<size_t> failures(0), mismatches(0), busy(0);
+   vector< vector<double> > latencies(connections);
+   vector<thread> clients;
+
+   const auto start = Clock::now();
+   for(size_t c = 0; c < connections; ++c) {
+      clients.emplace_back([&, c] {
+         const int fd = connectTo(args[0]);
+         if(fd < 0) {
+            cerr << "Cannot connect to " << args[0] << ": " << strerror(errno) << endl;
+            ++failures;
+            return;
+         }
+         vector<uint8_t> frame, response;
+         for(size_t i; (i = nextRequest++) < requests; ) {
+            const Header& header = headers[i % headers.size()];
+            frame.assign(4, 0);
+            kpabed::putU32(frame, static_cast<uint32_t>(i));
+            kpabed::putU32(frame, keyIndex);
+            frame.insert(frame.end(), header.Cw.begin(), header.Cw.end());
+
+            const auto sent = Clock::now();
+            if(!kpabed::writeFrame(fd, frame) || !kpabed::readFrame(fd, response) ||
+               response.size() < 5 || kpabed::getU32(response.data()) != i) {
+               ++failures;
+               break;
+            }
+            latencies[c].push_back(
+               chrono::duration<double, micro>(Clock::now() - sent).count());
+
+            if(response[4] == kpabed::BUSY) {
+               ++busy;
+            } else if(response[4] != kpabed::OK) {
+               ++failures;
+            } else if(response.size() != 5 + kpabed::FILE_KEY_SIZE ||
+                      !equal(header.fileKey.begin(), header.fileKey.end(), response.begin() + 5)) {
+               ++mismatches;
+            }
+         }
+         close(fd);
+      });
+   }
+   for(auto& client: clients) {
+      client.join();
+   }
+   const double seconds = chrono::duration<double>(Clock::now() - start).count();
+
+   vector<double> all;
+   for(auto& connectionLatencies: latencies) {
+      all.insert(all.end(), connectionLatencies.begin(), connectionLatencies.end());
+   }
+   sort(all.begin(), all.end());
+   auto percentile = [&](double p) {
+      return all.empty() ? 0.0 : all[static_cast<size_t>(p * (all.size() - 1))];
+   };
+
+   printf("%zu requests over %zu connections in %.3f s: %.1f req/s\n",
+          all.size(), connections, seconds, seconds > 0 ? all.size() / seconds : 0.0);
+   printf("latency p50 %.1f us, p99 %.1f us, max %.1f us\n",
+          percentile(0.5), percentile(0.99), all.empty() ? 0.0 : all.back());
+   printf("%zu failed, %zu busy, %zu wrong keys\n", failures.load(), busy.load(),
+          mismatches.load());
+   return failures || mismatches ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/md.h>
+#include <pbc.h>
+
+#include "kpabe_random.hpp"
+
+using namespace std;
+
+static const size_t RANDOM_BUFFER_SIZE = 4096;
+static const size_t SHA256_SIZE = 32;
+static const char* PERSONALIZATION = "kpabe-yct14";
+
+// Bumped whenever the source changes, so that threads reseed on their next draw.
+static atomic<unsigned long> generation(1);
+static atomic<bool> sourceChosen(false);
+static atomic<unsigned long> nextThreadIndex(0);
+
+static mutex seedMutex;
+static bool deterministic = false;
+static string deterministicSeed;
+
+struct ThreadRandom {
+   mbedtls_ctr_drbg_context drbg;
+   mbedtls_entropy_context entropy;
+   array<uint8_t, RANDOM_BUFFER_SIZE> buffer;
+   size_t pos = RANDOM_BUFFER_SIZE;
+   unsigned long seededGeneration = 0;
+
+   // Deterministic entropy: SHA-256(seed || threadIndex || counter) blocks.
+   string seed;
+   unsigned long threadIndex = 0;
+   unsigned long counter = 0;
+
+   ThreadRandom() {
+      mbedtls_ctr_drbg_init(&drbg);
+      mbedtls_entropy_init(&entropy);
+   }
+
+   ~ThreadRandom() {
+      mbedtls_ctr_drbg_free(&drbg);
+      mbedtls_entropy_free(&entropy);
+   }
+
+   void reseed();
+   void refill();
+   void read(uint8_t* out, size_t len);
+};
+
+static thread_local ThreadRandom threadRandom;
+
+/**
+ * PBC calls the random function from C, so failures cannot be thrown through it. Keys
+ * and ciphertexts must never be made from a failed generator, so give up.
+ */
+static void randomFailure(const char* call, int ret) {
+   fprintf(stderr, "kpabe: %s failed (-0x%04x), aborting\n", call, static_cast<unsigned>(-ret));
+   abort();
+}
+
+static int deterministicEntropy(void* data, uint8_t* output, size_t len) {
+   auto state = static_cast<ThreadRandom*>(data);
+   auto mdInfo = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+
+   vector<uint8_t> input(state->seed.begin(), state->seed.end());
+   const size_t prefixLen = input.size();
+   input.resize(prefixLen + 2 * sizeof(unsigned long));
+   memcpy(&input[prefixLen], &state->threadIndex, sizeof(unsigned long));
+
+   uint8_t block[SHA256_SIZE];
+   while(len > 0) {
+      memcpy(&input[prefixLen + sizeof(unsigned long)], &state->counter, sizeof(unsigned long));
+      ++state->counter;
+      const int ret = mbedtls_md(mdInfo, input.data(), input.size(), block);
+      if(ret != 0) {
+         return ret;
+      }
+      const size_t n = min(len, SHA256_SIZE);
+      memcpy(output, block, n);
+      output += n;
+      len -= n;
+   }
+   return 0;
+}
+
+void ThreadRandom::reseed() {
+   bool isDeterministic;
+   {
+      lock_guard<mutex> lock(seedMutex);
+      seededGeneration = generation.load();
+      isDeterministic = deterministic;
+      seed = deterministicSeed;
+   }
+
+   mbedtls_ctr_drbg_free(&drbg);
+   mbedtls_ctr_drbg_init(&drbg);
+   const auto personalization = reinterpret_cast<const uint8_t*>(PERSONALIZATION);
+   const size_t personalizationLen = strlen(PERSONALIZATION);
+   pos = buffer.size();
+   int ret;
+   if(isDeterministic) {
+      threadIndex = nextThreadIndex++;
+      counter = 0;
+      ret = mbedtls_ctr_drbg_seed(&drbg, deterministicEntropy, this,
+                                  personalization, personalizationLen);
+   } else {
+      ret = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy,
+                                  personalization, personalizationLen);
+   }
+   if(ret != 0) {
+      seededGeneration = 0;
+      randomFailure("mbedtls_ctr_drbg_seed", ret);
+   }
+}
+
+void ThreadRandom::refill() {
+   for(size_t offset = 0; offset < buffer.size(); offset += MBEDTLS_CTR_DRBG_MAX_REQUEST) {
+      const size_t n = min(buffer.size() - offset, size_t(MBEDTLS_CTR_DRBG_MAX_REQUEST));
+      const int ret = mbedtls_ctr_drbg_random(&drbg, buffer.data() + offset, n);
+      if(ret != 0) {
+         // Nothing of a partially filled buffer is handed out.
+         pos = buffer.size();
+         randomFailure("mbedtls_ctr_drbg_random", ret);
+      }
+   }
+   pos = 0;
+}
+
+void ThreadRandom::read(uint8_t* out, size_t len) {
+   if(seededGeneration != generation.load()) {
+      reseed();
+   }
+   while(len > 0) {
+      if(pos == buffer.size()) {
+         refill();
+      }
+      const size_t n = min(len, buffer.size() - pos);
+      memcpy(out, buffer.data() + pos, n);
+      // Do not keep handed out randomness around.
+      memset(buffer.data() + pos, 0, n);
+      pos += n;
+      out += n;
+      len -= n;
+   }
+}
+
+/**
+ * PBC random function: sets z to a uniformly random value in [0, limit).
+ */
+static void bufferedRandom(mpz_t z, mpz_t limit, void*) {
+   const size_t bits = mpz_sizeinbase(limit, 2);
+   const size_t len = (bits + 7) / 8;
+   const uint8_t topMask = static_cast<uint8_t>(0xff >> (8 * len - bits));
+
+   array<uint8_t, 128> stackBytes;
+   vector<uint8_t> heapBytes;
+   uint8_t* bytes = stackBytes.data();
+   if(len > stackBytes.size()) {
+      heapBytes.resize(len);
+      bytes = heapBytes.data();
+   }
+
+   // Rejection sampling keeps the result unbiased.
+   do {
+      threadRandom.read(bytes, len);
+      bytes[0] &= topMask;
+      mpz_import(z, len, 1, 1, 1, 0, bytes);
+   } while(mpz_cmp(z, limit) >= 0);
+
+   memset(bytes, 0, len);
+}
+
+void useBufferedRandom() {
+   {
+      lock_guard<mutex> lock(seedMutex);
+      deterministic = false;
+      deterministicSeed.clear();
+      ++generation;
+   }
+   sourceChosen = true;
+   pbc_random_set_function(bufferedRandom, nullptr);
+}
+
+void useDeterministicRandom(const string& seed) {
+   {
+      lock_guard<mutex> lock(seedMutex);
+      deterministic = true;
+      deterministicSeed = seed;
+      nextThreadIndex = 0;
+      ++generation;
+   }
+   sourceChosen = true;
+   pbc_random_set_function(bufferedRandom, nullptr);
+}
+
+void useSystemRandom() {
+   sourceChosen = true;
+   char urandom[] = "/dev/urandom";
+   pbc_random_set_file(urandom);
+}
+
+void initRandom() {
+   if(!sourceChosen) {
+      useBufferedRandom();
+   }
+}
@@ -0,0 +1,46 @@
+#ifndef kpabe_random_
+#define kpabe_random_
+
+#include <string>
+
+#pragma GCC visibility push(default)
+
+/*
+ * Randomness for element_random.
+ *
+ * By default (once getPairing() has been called) PBC draws from a per-thread mbedtls
+ * CTR_DRBG instead of reading /dev/urandom. Every thread has its own generator, so
+ * threads do not contend, and output is buffered so that most draws are a memcpy.
+ *
+ * If seeding or generating fails, the process aborts rather than hand out predictable
+ * or zero bytes (PBC calls the generator from C, so there is no error path).
+ */
+
+/**
+ * @brief Uses a per-thread CTR_DRBG seeded from the mbedtls entropy source.
+ */
+void useBufferedRandom();
+
+/**
+ * @brief Uses per-thread CTR_DRBGs seeded deterministically from the given seed.
+ *
+ * The n-th thread to draw after this call gets a stream derived from the seed and n, so
+ * results are reproducible as long as threads start drawing in the same order. This is
+ * meant for benchmarks and tests only.
+ */
+void useDeterministicRandom(const std::string& seed);
+
+/**
+ * @brief Restores PBC's own random source (/dev/urandom).
+ */
+void useSystemRandom();
+
+/**
+ * @brief Installs the buffered generator unless a source was already chosen.
+ *
+ * Called by getPairing().
+ */
+void initRandom();
+
+#pragma GCC visibility pop
+#endif
@@ -0,0 +1,339 @@
+#ifndef kpabe_static_
+#define kpabe_static_
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <climits>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include <pbc.h>
+
+#include "kpabe.hpp"
+
+#pragma GCC visibility push(default)
+
+/*
+ * Compile-time access policies.
+ *
+ * A policy shape that is known at build time can be written as a type, e.g.
+ *
+ *    typedef StaticPolicy< And< AnyOf<1, 2>, AnyOf<3, 4> > > Policy;
+ *
+ * The leaf layout, the thresholds and the Lagrange coefficient of every leaf are then
+ * resolved by the compiler. Policy::recoverSecret does not allocate containers or
+ * recurse at runtime, and computes the same secret as the runtime Node path for a key
+ * generated from Policy::toNode().
+ */
+
+namespace kpabe_static_detail {
+
+constexpr long long binomial(unsigned int n, unsigned int k) {
+   long long result = 1;
+   for(unsigned int i = 1; i <= k; ++i) {
+      result = result * (n - k + i) / i;
+   }
+   return result;
+}
+
+/**
+ * The Lagrange coefficient of point index (1-based) when interpolating p(0) from the
+ * points 1..threshold. This reduces to (-1)^(index + 1) * binomial(threshold, index).
+ */
+constexpr long long lagrangeAtZero(unsigned int threshold, unsigned int index) {
+   return (index % 2 ? 1 : -1) * binomial(threshold, index);
+}
+
+template<Node::Type T, std::size_t Offset, unsigned int Index, unsigned int Count,
+         class... Children>
+struct GateChildren {
+   static constexpr std::size_t leafCount = 0;
+
+   template<std::size_t N>
+   static void mark(const std::vector<int>&, std::bitset<N>&) { }
+
+   template<std::size_t N>
+   static bool satisfied(const std::bitset<N>&) {
+      return T == Node::Type::AND;
+   }
+
+   template<long long Coeff, std::size_t N, class Sink>
+   static bool emit(const std::bitset<N>&, Sink&) {
+      return false;
+   }
+
+   static bool matches(const Node*) {
+      return true;
+   }
+
+   static void addTo(Node&) { }
+};
+
+template<Node::Type T, std::size_t Offset, unsigned int Index, unsigned int Count,
+         class Child, class... Rest>
+struct GateChildren<T, Offset, Index, Count, Child, Rest...> {
+   typedef GateChildren<T, Offset + Child::leafCount, Index + 1, Count, Rest...> Next;
+
+   static constexpr std::size_t leafCount = Child::leafCount + Next::leafCount;
+
+   // An OR gate has threshold 1, so its only coefficient is 1.
+   static constexpr long long factor =
+      T == Node::Type::AND ? lagrangeAtZero(Count, Index + 1) : 1;
+
+   template<std::size_t N>
+   static void mark(const std::vector<int>& attributes, std::bitset<N>& mask) {
+      Child::template mark<Offset>(attributes, mask);
+      Next::mark(attributes, mask);
+   }
+
+   template<std::size_t N>
+   static bool satisfied(const std::bitset<N>& mask) {
+      if(T == Node::Type::AND) {
+         return Child::template satisfied<Offset>(mask) && Next::satisfied(mask);
+      }
+      return Child::template satisfied<Offset>(mask) || Next::satisfied(mask);
+   }
+
+   /**
+    * Emits the leafs of all children (AND) or of the first satisfied child (OR). Assumes
+    * that the gate is satisfied.
+    */
+   template<long long Coeff, std::size_t N, class Sink>
+   static bool emit(const std::bitset<N>& mask, Sink& sink) {
+      if(T == Node::Type::AND) {
+         Child::template emit<Offset, Coeff * factor>(mask, sink);
+         Next::template emit<Coeff>(mask, sink);
+         return true;
+      }
+      if(Child::template satisfied<Offset>(mask)) {
+         Child::template emit<Offset, Coeff>(mask, sink);
+         return true;
+      }
+      return Next::template emit<Coeff>(mask, sink);
+   }
+
+   static bool matches(const Node* children) {
+      return Child::matches(children[0]) && Next::matches(children + 1);
+   }
+
+   static void addTo(Node& node) {
+      node.addChild(Child::toNode());
+      Next::addTo(node);
+   }
+};
+
+} // namespace kpabe_static_detail
+
+/**
+ * @brief A leaf of a compile-time policy.
+ */
+template<int A>
+struct Attr {
+   static constexpr std::size_t leafCount = 1;
+
+   template<std::size_t Offset, std::size_t N>
+   static void mark(const std::vector<int>& attributes, std::bitset<N>& mask) {
+      mask[Offset] = std::find(attributes.begin(), attributes.end(), A) != attributes.end();
+   }
+
+   template<std::size_t Offset, std::size_t N>
+   static bool satisfied(const std::bitset<N>& mask) {
+      return mask[Offset];
+   }
+
+   template<std::size_t Offset, long long Coeff, std::size_t N, class Sink>
+   static void emit(const std::bitset<N>&, Sink& sink) {
+      static_assert(Coeff >= LONG_MIN && Coeff <= LONG_MAX,
+                    "Lagrange coefficient does not fit in a long");
+      sink(Offset, A, static_cast<long>(Coeff));
+   }
+
+   static bool matches(const Node& node) {
+      return node.getChildren().empty() && node.attr == A;
+   }
+
+   static Node toNode() {
+      return Node(A);
+   }
+};
+
+/**
+ * @brief A threshold gate of a compile-time policy.
+ */
+template<Node::Type T, class... Children>
+struct Gate {
+   static_assert(sizeof...(Children) > 0, "A gate needs at least one child");
+
+   template<std::size_t Offset>
+   using ChildList = kpabe_static_detail::GateChildren<
+      T, Offset, 0, sizeof...(Children), Children...>;
+
+   static constexpr std::size_t leafCount = ChildList<0>::leafCount;
+
+   template<std::size_t Offset, std::size_t N>
+   static void mark(const std::vector<int>& attributes, std::bitset<N>& mask) {
+      ChildList<Offset>::mark(attributes, mask);
+   }
+
+   template<std::size_t Offset, std::size_t N>
+   static bool satisfied(const std::bitset<N>& mask) {
+      return ChildList<Offset>::satisfied(mask);
+   }
+
+   template<std::size_t Offset, long long Coeff, std::size_t N, class Sink>
+   static void emit(const std::bitset<N>& mask, Sink& sink) {
+      ChildList<Offset>::template emit<Coeff>(mask, sink);
+   }
+
+   static bool matches(const Node& node) {
+      const auto& children = node.getChildren();
+      return node.getType() == T && children.size() == sizeof...(Children) &&
+             ChildList<0>::matches(children.data());
+   }
+
+   static Node toNode() {
+      Node node(T);
+      ChildList<0>::addTo(node);
+      return node;
+   }
+};
+
+template<class... Children>
+using And = Gate<Node::Type::AND, Children...>;
+
+template<class... Children>
+using Or = Gate<Node::Type::OR, Children...>;
+
+template<int... Attrs>
+using AllOf = And< Attr<Attrs>... >;
+
+template<int... Attrs>
+using AnyOf = Or< Attr<Attrs>... >;
+
+/**
+ * @brief Key generation and secret recovery for a compile-time policy.
+ */
+template<class Root>
+class StaticPolicy {
+
+   typedef std::bitset<Root::leafCount> Mask;
+
+   /**
+    * Sums Di * coeff(i) per attribute over the emitted leafs, then computes
+    * Cs = P(Ci ^ exponent(attr)) with one exponentiation per attribute.
+    */
+   struct ProductSink {
+      DecryptionKey& key;
+      std::array<int, Root::leafCount> attrs;
+      std::array<element_s, Root::leafCount> exponents;
+      std::size_t count;
+      element_t term;
+
+      explicit ProductSink(DecryptionKey& key): key(key), count(0) {
+         element_init_Zr(term, getPairing());
+      }
+
+      ~ProductSink() {
+         for(std::size_t i = 0; i < count; ++i) {
+            element_clear(&exponents[i]);
+         }
+         element_clear(term);
+      }
+
+      void operator()(std::size_t leaf, int attr, long coeff) {
+         element_mul_si(term, &key.Di.at(leaf), coeff);
+         for(std::size_t i = 0; i < count; ++i) {
+            if(attrs[i] == attr) {
+               element_add(&exponents[i], &exponents[i], term);
+               return;
+            }
+         }
+         attrs[count] = attr;
+         element_init_Zr(&exponents[count], getPairing());
+         element_set(&exponents[count], term);
+         ++count;
+      }
+
+      // Initializes Cs.
+      void apply(Cw_t& Cw, element_s& Cs) {
+         // Look up every Ci first, so that a missing one throws before anything is
+         // initialized.
+         std::array<element_s*, Root::leafCount> Ci;
+         for(std::size_t i = 0; i < count; ++i) {
+            Ci[i] = &Cw.at(attrs[i]);
+         }
+
+         element_init_G1(&Cs, getPairing());
+         element_t Zy;
+         element_init_G1(Zy, getPairing());
+         for(std::size_t i = 0; i < count; ++i) {
+            powG1(Zy, Ci[i], &exponents[i]);
+            if(i > 0) {
+               element_mul(&Cs, &Cs, Zy);
+            } else {
+               element_set(&Cs, Zy);
+            }
+         }
+         element_clear(Zy);
+      }
+   };
+
+public:
+   static constexpr std::size_t leafCount = Root::leafCount;
+
+   /**
+    * @brief Returns the equivalent runtime policy.
+    */
+   static Node toNode() {
+      return Root::toNode();
+   }
+
+   static DecryptionKey keyGeneration(PrivateParams& privateParams) {
+      Node policy = toNode();
+      return ::keyGeneration(privateParams, policy);
+   }
+
+   static bool isSatisfiedBy(const std::vector<int>& attributes) {
+      Mask mask;
+      Root::template mark<0>(attributes, mask);
+      return Root::template satisfied<0>(mask);
+   }
+
+   /**
+    * @brief Returns whether the key was generated for this policy (same tree and one
+    * share per leaf).
+    */
+   static bool matches(const DecryptionKey& key) {
+      return key.Di.size() == leafCount && Root::matches(key.accessPolicy);
+   }
+
+   /**
+    * @brief Recovers a KP-ABE secret with a key generated for this policy.
+    *
+    * @throws std::invalid_argument if the key was generated for another policy.
+    * @throws UnsatError if the attributes do not satisfy the policy.
+    * @throws std::out_of_range if Cw lacks an attribute that the recovery uses.
+    */
+   static void recoverSecret(DecryptionKey& key,
+                             Cw_t& Cw,
+                             const std::vector<int>& attributes,
+                             element_s& Cs) {
+      if(!matches(key)) {
+         throw std::invalid_argument("Key was not generated for this policy");
+      }
+      Mask mask;
+      Root::template mark<0>(attributes, mask);
+      if(!Root::template satisfied<0>(mask)) {
+         throw UnsatError();
+      }
+
+      ProductSink sink(key);
+      Root::template emit<0, 1>(mask, sink);
+      sink.apply(Cw, Cs);
+   }
+};
+
+#pragma GCC visibility pop
+#endif
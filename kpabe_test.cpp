@@ -4,11 +4,17 @@
 #include <vector>
 #include <string>
 #include <iostream>
+#include <cstring>
+#include <thread>
 
 #include <boost/test/unit_test.hpp>
 #include <pbc.h>
 
 #include "kpabe.hpp"
+#include "kpabe_bounded.hpp"
+#include "kpabe_random.hpp"
+#include "kpabe_static.hpp"
+#include "kpabe_typea.hpp"
 
 using namespace std;
 
@@ -153,11 +159,10 @@ BOOST_FIXTURE_TEST_CASE(createSecretTest, InitPolicy) {
    auto key = keyGeneration(priv, root);
    vector<int> expectedAttributes {1, 2, 3, 4};
    
+   BOOST_CHECK(key.accessPolicy.getLeafs() == expectedAttributes);
    BOOST_CHECK(expectedAttributes.size() == key.Di.size());
-   for(auto attr: expectedAttributes) {
-      auto attrDuPairIter = key.Di.find(attr);
-      BOOST_CHECK(attrDuPairIter != key.Di.end());
-      element_clear(&attrDuPairIter->second);
+   for(auto& Di: key.Di) {
+      element_clear(&Di);
    }
 }
 
@@ -175,8 +180,8 @@ BOOST_FIXTURE_TEST_CASE(createSecretAndRecoverSecret, InitGenerator) {
       element_clear(&attrCiPair.second);
    }
    
-   for(auto& attrDiPair: decKeyPolicy.Di) {
-      element_clear(&attrDiPair.second);
+   for(auto& Di: decKeyPolicy.Di) {
+      element_clear(&Di);
    }
    
    element_clear(&CsEnc);
@@ -201,10 +206,729 @@ BOOST_FIXTURE_TEST_CASE(encryptAndDecrypt, InitGenerator) {
       element_clear(&attrCiPair.second);
    }
    
-   for(auto& attrDiPair: key.Di) {
-      element_clear(&attrDiPair.second);
+   for(auto& Di: key.Di) {
+      element_clear(&Di);
    }
    
    BOOST_CHECK(msg == message);
 }
 
+
+BOOST_FIXTURE_TEST_CASE(ciphertextIndexQuery, InitPolicy) {
+   // (one or two) and (three or four)
+   CiphertextIndex index;
+   auto both = index.add(vector<int> {1, 3});
+   index.add(vector<int> {1});
+   auto all = index.add(vector<int> {1, 2, 3, 4});
+   index.add(vector<int> {3, 4});
+   auto other = index.add(vector<int> {2, 4, 5});
+
+   vector<CiphertextIndex::Id> expected {both, all, other};
+   BOOST_CHECK(index.query(root) == expected);
+
+   Node leaf(5);
+   BOOST_CHECK(index.query(leaf) == vector<CiphertextIndex::Id> {other});
+   BOOST_CHECK(index.query(Node(6)).empty());
+   BOOST_CHECK(index.size() == 5);
+}
+
+BOOST_AUTO_TEST_CASE(parsePolicyTest) {
+   PolicyPool pool;
+   auto policy = pool.parse("(1 OR 2) AND (3 or 4)");
+   BOOST_CHECK(policy->type == Node::Type::AND);
+   BOOST_CHECK(policy->getLeafs() == vector<int>({1, 2, 3, 4}));
+   BOOST_CHECK(policy->children[0]->getThreshold() == 1);
+   BOOST_CHECK(pool.parse("1 OR 2 OR 3")->children.size() == 3);
+
+   // AND binds tighter than OR.
+   auto mixed = pool.parse("1 OR 2 AND 3");
+   BOOST_CHECK(mixed->type == Node::Type::OR);
+   BOOST_CHECK(mixed->children[1]->type == Node::Type::AND);
+
+   // Identical subtrees are shared, across and within policies.
+   auto other = pool.parse("((1 OR 2)) AND 5");
+   BOOST_CHECK(other->children[0] == policy->children[0]);
+   BOOST_CHECK(pool.parse("(1 OR 2) AND (3 OR 4)") == policy);
+
+   auto node = policy->toNode();
+   BOOST_CHECK(node.getLeafs() == policy->getLeafs());
+   BOOST_CHECK(parsePolicy("(1 OR 2) AND (3 or 4)").toString() == node.toString());
+
+   for(auto bad: {"", "1 AND", "(1 OR 2", "1 2", "1 OR x", "ANDROID"}) {
+      BOOST_CHECK_THROW(pool.parse(bad), PolicyParseError);
+      BOOST_CHECK_THROW(parsePolicy(bad), PolicyParseError);
+   }
+   BOOST_CHECK(parsePolicy(string(64, '(') + "1" + string(64, ')')).getLeafs() == vector<int>({1}));
+   BOOST_CHECK_THROW(parsePolicy(string(100000, '(') + "1" + string(100000, ')')), PolicyParseError);
+}
+
+BOOST_FIXTURE_TEST_CASE(pooledPolicyKeys, InitGenerator) {
+   PolicyPool pool;
+   auto first = pool.parse("(1 OR 2) AND (3 OR 4)");
+   auto second = pool.parse("(1 OR 2) AND 4");
+   BOOST_CHECK(&pool.coefficients(first->children[0]) == &pool.coefficients(second->children[0]));
+   BOOST_CHECK(pool.coefficients(first).size() == 2);
+
+   auto firstKey = keyGeneration(priv, first);
+   auto secondKey = keyGeneration(priv, second);
+   auto thirdKey = keyGeneration(priv, first);
+   BOOST_CHECK(firstKey.accessPolicy.toString() == "(1 OR 2) AND (3 OR 4)");
+
+   element_s CsEnc, CsDec;
+   vector<int> encAttr {1, 3, 4};
+   auto Cw = createSecret(pub, encAttr, CsEnc);
+
+   // first: the root, (1 OR 2), 1, (3 OR 4) and 3. second only adds its root and 4,
+   // and a second key with the first policy reuses all of them.
+   auto plan = planDecryption(firstKey, pool, first, encAttr);
+   BOOST_CHECK(pool.planEvaluations() == 5);
+   auto secondPlan = planDecryption(secondKey, pool, second, encAttr);
+   BOOST_CHECK(pool.planEvaluations() == 7);
+   auto thirdPlan = planDecryption(thirdKey, pool, first, encAttr);
+   BOOST_CHECK(pool.planEvaluations() == 7);
+
+   for(auto planPtr: {&plan, &secondPlan, &thirdPlan}) {
+      applyDecryption(*planPtr, Cw, CsDec);
+      BOOST_CHECK(!element_cmp(&CsEnc, &CsDec));
+      element_clear(&CsDec);
+   }
+   // The pooled key is an ordinary key.
+   recoverSecret(firstKey, Cw, encAttr, CsDec);
+   BOOST_CHECK(!element_cmp(&CsEnc, &CsDec));
+   element_clear(&CsDec);
+
+   vector<int> unsatAttr {1, 2};
+   BOOST_CHECK_THROW(planDecryption(firstKey, pool, first, unsatAttr), UnsatError);
+   BOOST_CHECK_THROW(planDecryption(secondKey, pool, first, encAttr), invalid_argument);
+   BOOST_CHECK_THROW(keyGeneration(priv, pool.parse("1 AND 99")), invalid_argument);
+
+   for(auto& attrCiPair: Cw) {
+      element_clear(&attrCiPair.second);
+   }
+   for(auto key: {&firstKey, &secondKey, &thirdKey}) {
+      for(auto& Di: key->Di) {
+         element_clear(&Di);
+      }
+   }
+   element_clear(&CsEnc);
+}
+
+BOOST_FIXTURE_TEST_CASE(parsedPolicyRecoverSecret, InitGenerator) {
+   element_s CsEnc, CsDec;
+   vector<int> encAttr {2, 4};
+   auto Cw = createSecret(pub, encAttr, CsEnc);
+
+   auto policy = parsePolicy("(1 OR 2) AND (3 OR 4)");
+   auto key = keyGeneration(priv, policy);
+   recoverSecret(key, Cw, encAttr, CsDec);
+
+   BOOST_CHECK(!element_cmp(&CsEnc, &CsDec));
+
+   for(auto& attrCiPair: Cw) {
+      element_clear(&attrCiPair.second);
+   }
+
+   for(auto& Di: key.Di) {
+      element_clear(&Di);
+   }
+
+   element_clear(&CsEnc);
+   element_clear(&CsDec);
+}
+
+BOOST_AUTO_TEST_CASE(staticPolicyRecoverSecret) {
+   PrivateParams priv;
+   PublicParams pub;
+   setup({1, 2, 3, 4, 5, 6}, pub, priv);
+
+   // (one or two) and (three or (four and five)) and six
+   typedef StaticPolicy< And< AnyOf<1, 2>, Or< Attr<3>, AllOf<4, 5> >, Attr<6> > > Policy;
+   static_assert(Policy::leafCount == 6, "Leafs are counted at compile time");
+
+   auto key = Policy::keyGeneration(priv);
+   BOOST_CHECK(key.accessPolicy.getLeafs() == vector<int>({1, 2, 3, 4, 5, 6}));
+
+   for(auto encAttr: vector< vector<int> > {{1, 3, 6}, {2, 4, 5, 6}, {1, 2, 3, 4, 5, 6}}) {
+      element_s CsEnc, CsStatic, CsDynamic;
+      auto Cw = createSecret(pub, encAttr, CsEnc);
+
+      BOOST_CHECK(Policy::isSatisfiedBy(encAttr));
+      Policy::recoverSecret(key, Cw, encAttr, CsStatic);
+      recoverSecret(key, Cw, encAttr, CsDynamic);
+      BOOST_CHECK(!element_cmp(&CsEnc, &CsStatic));
+      BOOST_CHECK(!element_cmp(&CsStatic, &CsDynamic));
+
+      for(auto& attrCiPair: Cw) {
+         element_clear(&attrCiPair.second);
+      }
+      element_clear(&CsEnc);
+      element_clear(&CsStatic);
+      element_clear(&CsDynamic);
+   }
+
+   for(auto& Di: key.Di) {
+      element_clear(&Di);
+   }
+}
+
+BOOST_FIXTURE_TEST_CASE(staticPolicyMatchesRuntime, InitGenerator) {
+   typedef StaticPolicy< And< AnyOf<1, 2>, AllOf<3, 4> > > Policy;
+   auto key = Policy::keyGeneration(priv);
+
+   element_s CsEnc, CsDec;
+   vector<int> encAttr {2, 3, 4};
+   auto Cw = createSecret(pub, encAttr, CsEnc);
+   Policy::recoverSecret(key, Cw, encAttr, CsDec);
+   BOOST_CHECK(!element_cmp(&CsEnc, &CsDec));
+   element_clear(&CsDec);
+
+   vector<int> unsatAttr {1, 3};
+   BOOST_CHECK(!Policy::isSatisfiedBy(unsatAttr));
+   BOOST_CHECK_THROW(Policy::recoverSecret(key, Cw, unsatAttr, CsDec), UnsatError);
+
+   // Keys for another policy, or with a share missing, are rejected.
+   auto otherKey = keyGeneration(priv, root);
+   BOOST_CHECK(!Policy::matches(otherKey));
+   BOOST_CHECK_THROW(Policy::recoverSecret(otherKey, Cw, encAttr, CsDec), invalid_argument);
+   DecryptionKey shortKey = key;
+   shortKey.Di.pop_back();
+   BOOST_CHECK_THROW(Policy::recoverSecret(shortKey, Cw, encAttr, CsDec), invalid_argument);
+
+   // A ciphertext without one of the attributes it claims.
+   Cw_t partialCw;
+   partialCw[2] = Cw[2];
+   partialCw[3] = Cw[3];
+   BOOST_CHECK_THROW(Policy::recoverSecret(key, partialCw, encAttr, CsDec), out_of_range);
+
+   for(auto& attrCiPair: Cw) {
+      element_clear(&attrCiPair.second);
+   }
+   for(auto Di: {&key.Di, &otherKey.Di}) {
+      for(auto& share: *Di) {
+         element_clear(&share);
+      }
+   }
+   element_clear(&CsEnc);
+}
+
+BOOST_AUTO_TEST_CASE(typeaFieldArithmetic) {
+   mpz_t q, a, b, expected, actual;
+   mpz_inits(q, a, b, expected, actual, NULL);
+   mpz_set_str(q, "87807107996633125224377819847540498158068831994142082"
+                  "1102865339926647563088022295707862517942266222142315585"
+                  "8769582317459277713367317481324925129998224791", 10);
+   gmp_randstate_t state;
+   gmp_randinit_default(state);
+
+   auto toFp = [](typea::Fp& out, mpz_t value) {
+      uint8_t bytes[typea::FIELD_BYTES] = { 0 };
+      size_t count = 0;
+      mpz_export(bytes + typea::FIELD_BYTES - (mpz_sizeinbase(value, 2) + 7) / 8,
+                 &count, 1, 1, 1, 0, value);
+      return typea::fpFromBytes(out, bytes);
+   };
+   auto toMpz = [](mpz_t out, const typea::Fp& value) {
+      uint8_t bytes[typea::FIELD_BYTES];
+      typea::fpToBytes(bytes, value);
+      mpz_import(out, typea::FIELD_BYTES, 1, 1, 1, 0, bytes);
+   };
+
+   for(int i = 0; i < 100; ++i) {
+      mpz_urandomm(a, state, q);
+      mpz_urandomm(b, state, q);
+      if(i == 0) {
+         mpz_sub_ui(a, q, 1); // Largest operands
+         mpz_sub_ui(b, q, 1);
+      }
+      typea::Fp fa, fb, result;
+      BOOST_REQUIRE(toFp(fa, a) && toFp(fb, b));
+
+      typea::fpMul(result, fa, fb);
+      toMpz(actual, result);
+      mpz_mul(expected, a, b);
+      mpz_mod(expected, expected, q);
+      BOOST_CHECK(mpz_cmp(expected, actual) == 0);
+
+      typea::fpSqr(result, fa);
+      toMpz(actual, result);
+      mpz_mul(expected, a, a);
+      mpz_mod(expected, expected, q);
+      BOOST_CHECK(mpz_cmp(expected, actual) == 0);
+
+      typea::fpAdd(result, fa, fb);
+      toMpz(actual, result);
+      mpz_add(expected, a, b);
+      mpz_mod(expected, expected, q);
+      BOOST_CHECK(mpz_cmp(expected, actual) == 0);
+
+      typea::fpSub(result, fa, fb);
+      toMpz(actual, result);
+      mpz_sub(expected, a, b);
+      mpz_mod(expected, expected, q);
+      BOOST_CHECK(mpz_cmp(expected, actual) == 0);
+
+      if(i < 5 && mpz_sgn(a) != 0) {
+         typea::fpInv(result, fa);
+         toMpz(actual, result);
+         mpz_invert(expected, a, q);
+         BOOST_CHECK(mpz_cmp(expected, actual) == 0);
+      }
+   }
+
+   typea::Fp unreduced;
+   BOOST_CHECK(!toFp(unreduced, q));
+
+   gmp_randclear(state);
+   mpz_clears(q, a, b, expected, actual, NULL);
+}
+
+BOOST_AUTO_TEST_CASE(powG1MatchesPbc) {
+   element_t base, exponent, expected, actual;
+   element_init_G1(base, getPairing());
+   element_init_G1(expected, getPairing());
+   element_init_G1(actual, getPairing());
+   element_init_Zr(exponent, getPairing());
+
+   for(int i = 0; i < 20; ++i) {
+      element_random(base);
+      element_random(exponent);
+      if(i == 0) {
+         element_set0(exponent);
+      } else if(i == 1) {
+         element_set1(exponent);
+      } else if(i == 2) {
+         element_set_si(exponent, -1);
+      }
+      element_pow_zn(expected, base, exponent);
+      powG1(actual, base, exponent);
+      BOOST_CHECK(!element_cmp(expected, actual));
+
+      uint8_t expectedBytes[128], actualBytes[128];
+      BOOST_REQUIRE(element_length_in_bytes(expected) <= sizeof(expectedBytes));
+      element_to_bytes(expectedBytes, expected);
+      element_to_bytes(actualBytes, actual);
+      BOOST_CHECK(!memcmp(expectedBytes, actualBytes, element_length_in_bytes(expected)));
+   }
+
+   element_set0(base);
+   powG1(actual, base, exponent);
+   BOOST_CHECK(element_is0(actual));
+
+   element_clear(base);
+   element_clear(exponent);
+   element_clear(expected);
+   element_clear(actual);
+}
+
+BOOST_AUTO_TEST_CASE(deterministicRandom) {
+   auto drawMasterKey = [](vector<uint8_t>& bytes) {
+      PrivateParams priv;
+      PublicParams pub;
+      setup({1}, pub, priv);
+      bytes.resize(element_length_in_bytes(&priv.mk));
+      element_to_bytes(bytes.data(), &priv.mk);
+   };
+
+   vector<uint8_t> first, second, third;
+   useDeterministicRandom("kpabe_test");
+   drawMasterKey(first);
+   useDeterministicRandom("kpabe_test");
+   drawMasterKey(second);
+   useBufferedRandom();
+   drawMasterKey(third);
+
+   BOOST_CHECK(first == second);
+   BOOST_CHECK(first != third);
+}
+
+BOOST_FIXTURE_TEST_CASE(addAttributesTest, InitGenerator) {
+   BOOST_CHECK(!element_cmp(&pub.g, &priv.g));
+   PublicParams freshPub;
+   PrivateParams freshPriv;
+   BOOST_CHECK_THROW(setup({1, 1}, freshPub, freshPriv), invalid_argument);
+
+   Node oldPolicy(Node::Type::AND, {Node(1), Node(2)});
+   auto oldKey = keyGeneration(priv, oldPolicy);
+
+   vector<int> newAttributes;
+   for(int attr = 5; attr < 205; ++attr) {
+      newAttributes.push_back(attr);
+   }
+   addAttributes(newAttributes, pub, priv);
+   BOOST_CHECK(pub.Pi.size() == 204 && priv.Si.size() == 204);
+   BOOST_CHECK_THROW(addAttributes({4}, pub, priv), invalid_argument);
+   BOOST_CHECK_THROW(addAttributes({300, 300}, pub, priv), invalid_argument);
+
+   // A key over old and new attributes.
+   Node policy(Node::Type::AND, {Node(1), Node(Node::Type::OR, {Node(7), Node(204)})});
+   auto key = keyGeneration(priv, policy);
+
+   element_s CsEnc, CsDec;
+   vector<int> encAttr {1, 204};
+   auto Cw = createSecret(pub, encAttr, CsEnc);
+   recoverSecret(key, Cw, encAttr, CsDec);
+   BOOST_CHECK(!element_cmp(&CsEnc, &CsDec));
+
+   // A key generated before the attributes were added, with a ciphertext that uses them.
+   element_s CsOld, CsOldDec;
+   vector<int> mixedAttr {1, 2, 7};
+   auto CwMixed = createSecret(pub, mixedAttr, CsOld);
+   recoverSecret(oldKey, CwMixed, mixedAttr, CsOldDec);
+   BOOST_CHECK(!element_cmp(&CsOld, &CsOldDec));
+
+   for(auto Ci: {&Cw, &CwMixed}) {
+      for(auto& attrCiPair: *Ci) {
+         element_clear(&attrCiPair.second);
+      }
+   }
+   for(auto Di: {&key.Di, &oldKey.Di}) {
+      for(auto& e: *Di) {
+         element_clear(&e);
+      }
+   }
+   element_clear(&CsEnc);
+   element_clear(&CsDec);
+   element_clear(&CsOld);
+   element_clear(&CsOldDec);
+}
+
+BOOST_FIXTURE_TEST_CASE(rotateAttributesTest, InitGenerator) {
+   Node policy(Node::Type::AND, {Node(1), Node(3)});
+   auto revokedKey = keyGeneration(priv, policy);
+   auto key = keyGeneration(priv, policy);
+
+   element_s CsEnc, CsDec;
+   vector<int> encAttr {1, 3};
+   vector<Cw_t> stored;
+   stored.push_back(createSecret(pub, encAttr, CsEnc));
+
+   BOOST_CHECK_THROW(rotateAttributes({9}, pub, priv), invalid_argument);
+   // Both parameter sets must know the attribute, and nothing is rotated otherwise.
+   element_s s3;
+   element_init_same_as(&s3, &priv.Si[3]);
+   element_set(&s3, &priv.Si[3]);
+   PublicParams partialPub = pub;
+   partialPub.Pi.erase(4);
+   BOOST_CHECK_THROW(rotateAttributes({3, 4}, partialPub, priv), invalid_argument);
+   BOOST_CHECK(!element_cmp(&s3, &priv.Si[3]));
+   element_clear(&s3);
+
+   auto tokens = rotateAttributes({3}, pub, priv);
+   BOOST_CHECK(tokens.size() == 1);
+   rekeyCiphertexts(tokens, stored);
+   rekeyKey(tokens, key);
+
+   recoverSecret(key, stored[0], encAttr, CsDec);
+   BOOST_CHECK(!element_cmp(&CsEnc, &CsDec));
+   element_clear(&CsDec);
+
+   recoverSecret(revokedKey, stored[0], encAttr, CsDec);
+   BOOST_CHECK(element_cmp(&CsEnc, &CsDec));
+   element_clear(&CsDec);
+   element_clear(&CsEnc);
+
+   // New ciphertexts use the rotated parameters.
+   auto Cw = createSecret(pub, encAttr, CsEnc);
+   recoverSecret(key, Cw, encAttr, CsDec);
+   BOOST_CHECK(!element_cmp(&CsEnc, &CsDec));
+   element_clear(&CsDec);
+   element_clear(&CsEnc);
+
+   for(auto Ci: {&Cw, &stored[0]}) {
+      for(auto& attrCiPair: *Ci) {
+         element_clear(&attrCiPair.second);
+      }
+   }
+   for(auto Di: {&key.Di, &revokedKey.Di}) {
+      for(auto& e: *Di) {
+         element_clear(&e);
+      }
+   }
+   for(auto& attrTokenPair: tokens) {
+      element_clear(&attrTokenPair.second);
+   }
+}
+
+BOOST_FIXTURE_TEST_CASE(policyToString, InitPolicy) {
+   BOOST_CHECK(root.toString() == "(1 OR 2) AND (3 OR 4)");
+   auto nested = parsePolicy("(1 AND 2) AND 3 OR 4");
+   BOOST_CHECK(nested.toString() == "((1 AND 2) AND 3) OR 4");
+   BOOST_CHECK(parsePolicy(nested.toString()).toString() == nested.toString());
+}
+
+BOOST_FIXTURE_TEST_CASE(serializationRoundTrip, InitGenerator) {
+   vector<uint8_t> pubBytes, privBytes, keyBytes, CwBytes;
+   serializePublicParams(pub, pubBytes);
+   serializePrivateParams(priv, privBytes);
+
+   PublicParams pub2;
+   PrivateParams priv2;
+   BOOST_CHECK(deserializePublicParams(pubBytes.data(), pubBytes.size(), pub2) == pubBytes.size());
+   BOOST_CHECK(deserializePrivateParams(privBytes.data(), privBytes.size(), priv2) == privBytes.size());
+   BOOST_CHECK(!element_cmp(&pub.pk, &pub2.pk) && !element_cmp(&priv.mk, &priv2.mk));
+   BOOST_CHECK(pub2.Pi.size() == 4 && priv2.Si.size() == 4);
+
+   auto key = keyGeneration(priv2, root);
+   serializeKey(key, keyBytes);
+   DecryptionKey key2(Node(0));
+   BOOST_CHECK(deserializeKey(keyBytes.data(), keyBytes.size(), key2) == keyBytes.size());
+
+   element_s CsEnc, CsDec;
+   vector<int> encAttr {2, 3};
+   auto Cw = createSecret(pub2, encAttr, CsEnc);
+   serializeCw(Cw, CwBytes);
+   Cw_t Cw2;
+   BOOST_CHECK(deserializeCw(CwBytes.data(), CwBytes.size(), Cw2) == CwBytes.size());
+
+   recoverSecret(key2, Cw2, encAttr, CsDec);
+   BOOST_CHECK(!element_cmp(&CsEnc, &CsDec));
+
+   Cw_t truncated, wrongTag;
+   BOOST_CHECK_THROW(deserializeCw(CwBytes.data(), CwBytes.size() - 1, truncated),
+                     invalid_argument);
+   BOOST_CHECK(truncated.empty());
+   BOOST_CHECK_THROW(deserializeCw(keyBytes.data(), keyBytes.size(), wrongTag), invalid_argument);
+   BOOST_CHECK(wrongTag.empty());
+
+   DecryptionKey truncatedKey(Node(0));
+   BOOST_CHECK_THROW(deserializeKey(keyBytes.data(), keyBytes.size() - 1, truncatedKey),
+                     invalid_argument);
+   BOOST_CHECK(truncatedKey.Di.empty());
+
+   // Keys with one share per attribute ("KPDK") are no longer read.
+   auto attributeKeyBytes = keyBytes;
+   attributeKeyBytes[3] = 'K';
+   DecryptionKey attributeKey(Node(0));
+   BOOST_CHECK_THROW(deserializeKey(attributeKeyBytes.data(), attributeKeyBytes.size(),
+                                    attributeKey), invalid_argument);
+
+   for(auto Ci: {&Cw, &Cw2}) {
+      for(auto& attrCiPair: *Ci) {
+         element_clear(&attrCiPair.second);
+      }
+   }
+   for(auto Di: {&key.Di, &key2.Di}) {
+      for(auto& e: *Di) {
+         element_clear(&e);
+      }
+   }
+   element_clear(&CsEnc);
+   element_clear(&CsDec);
+}
+
+BOOST_FIXTURE_TEST_CASE(repeatedAttributes, InitGenerator) {
+   Node policy = parsePolicy("(1 OR 2) AND (1 OR 3)");
+   auto key = keyGeneration(priv, policy);
+   BOOST_CHECK(key.Di.size() == 4);
+
+   vector< vector<int> > satisfying {{1}, {2, 3}, {1, 3}, {2, 1}};
+   for(auto& encAttr: satisfying) {
+      element_s CsEnc, CsDec;
+      auto Cw = createSecret(pub, encAttr, CsEnc);
+      recoverSecret(key, Cw, encAttr, CsDec);
+      BOOST_CHECK(!element_cmp(&CsEnc, &CsDec));
+
+      vector<uint8_t> scratch(boundedScratchSize(policy));
+      uint8_t expected[32], fileKey[32];
+      hashElement(&CsEnc, expected);
+      BOOST_CHECK(recoverKeyBounded(key, Cw, encAttr, scratch.data(), scratch.size(), fileKey));
+      BOOST_CHECK(!memcmp(expected, fileKey, sizeof(fileKey)));
+
+      for(auto& attrCiPair: Cw) {
+         element_clear(&attrCiPair.second);
+      }
+      element_clear(&CsEnc);
+      element_clear(&CsDec);
+   }
+
+   // Both leafs of attribute 1 are used, but it costs a single exponentiation.
+   vector<int> onlyOne {1};
+   auto plan = planDecryption(key, onlyOne);
+   BOOST_CHECK(plan.exponents.size() == 1 && plan.exponents[0].first == 1);
+
+   vector<int> unsat {2};
+   BOOST_CHECK_THROW(planDecryption(key, unsat), UnsatError);
+
+   typedef StaticPolicy< And< AnyOf<1, 2>, AnyOf<1, 3> > > Policy;
+   vector<int> encAttr {1};
+   element_s CsEnc, CsDec;
+   auto Cw = createSecret(pub, encAttr, CsEnc);
+   Policy::recoverSecret(key, Cw, encAttr, CsDec);
+   BOOST_CHECK(!element_cmp(&CsEnc, &CsDec));
+
+   for(auto& attrCiPair: Cw) {
+      element_clear(&attrCiPair.second);
+   }
+   for(auto& Di: key.Di) {
+      element_clear(&Di);
+   }
+   element_clear(&CsEnc);
+   element_clear(&CsDec);
+}
+
+BOOST_FIXTURE_TEST_CASE(boundedDecryption, InitGenerator) {
+   auto key = keyGeneration(priv, root);
+   vector<int> encAttr {2, 3};
+   element_s Cs, CsDec;
+   auto Cw = createSecret(pub, encAttr, Cs);
+   recoverSecret(key, Cw, encAttr, CsDec);
+
+   vector<uint8_t> scratch(boundedScratchSize(root));
+   uint8_t expected[32], fileKey[32];
+   hashElement(&CsDec, expected);
+   ScratchUsage usage;
+   BOOST_CHECK(recoverKeyBounded(key, Cw, encAttr, scratch.data(), scratch.size(), fileKey, &usage));
+   BOOST_CHECK(!memcmp(expected, fileKey, sizeof(fileKey)));
+   BOOST_CHECK(usage.peak > 0 && usage.peak <= scratch.size());
+   BOOST_CHECK(usage.overflowBytes == 0);
+
+   vector<int> unsatAttr {1, 2};
+   BOOST_CHECK(!recoverKeyBounded(key, Cw, unsatAttr, scratch.data(), scratch.size(), fileKey));
+   BOOST_CHECK_THROW(recoverKeyBounded(key, Cw, encAttr, scratch.data(), 64, fileKey),
+                     ScratchOverflowError);
+
+   string message = "Hello, bounded world!";
+   Cw_t CwMsg;
+   auto ciphertext = encrypt(pub, encAttr, message, CwMsg);
+   vector<uint8_t> plaintext(ciphertext.size());
+   size_t plaintextLen = decryptBounded(key, CwMsg, encAttr, ciphertext.data(), ciphertext.size(),
+                                        plaintext.data(), scratch.data(), scratch.size());
+   BOOST_CHECK(plaintextLen == message.size() + 1);
+   BOOST_CHECK(string(reinterpret_cast<char*>(plaintext.data())) == message);
+   BOOST_CHECK_THROW(decryptBounded(key, CwMsg, unsatAttr, ciphertext.data(), ciphertext.size(),
+                                    plaintext.data(), scratch.data(), scratch.size()),
+                     UnsatError);
+
+   // The hooks are installed once and stay installed between bounded calls.
+   auto pbcMalloc = pbc_malloc;
+   BOOST_CHECK(recoverKeyBounded(key, Cw, encAttr, scratch.data(), scratch.size(), fileKey));
+   BOOST_CHECK(pbc_malloc == pbcMalloc);
+
+   for(auto Ci: {&Cw, &CwMsg}) {
+      for(auto& attrCiPair: *Ci) {
+         element_clear(&attrCiPair.second);
+      }
+   }
+   for(auto& Di: key.Di) {
+      element_clear(&Di);
+   }
+   element_clear(&Cs);
+   element_clear(&CsDec);
+}
+
+BOOST_FIXTURE_TEST_CASE(boundedDecryptionDeepPolicy, InitGenerator) {
+   // Every AND level keeps two coefficients live and calls element_mul_si, element_div and
+   // element_neg on them.
+   Node policy = parsePolicy("(1 AND 2 AND 3 AND 4) AND ((1 AND 2 AND 3) AND ((1 AND 2) AND "
+                             "(3 AND (4 AND ((1 OR 2) AND (3 AND 4))))))");
+   auto key = keyGeneration(priv, policy);
+   vector<int> encAttr {1, 2, 3, 4};
+   element_s Cs;
+   auto Cw = createSecret(pub, encAttr, Cs);
+   uint8_t expected[32], fileKey[32];
+   hashElement(&Cs, expected);
+
+   vector<uint8_t> scratch(boundedScratchSize(policy));
+   ScratchUsage usage;
+   BOOST_CHECK(recoverKeyBounded(key, Cw, encAttr, scratch.data(), scratch.size(), fileKey, &usage));
+   BOOST_CHECK(!memcmp(expected, fileKey, sizeof(fileKey)));
+   BOOST_CHECK(usage.peak <= scratch.size());
+   BOOST_CHECK(usage.overflowBytes == 0);
+
+   for(auto& attrCiPair: Cw) {
+      element_clear(&attrCiPair.second);
+   }
+   for(auto& Di: key.Di) {
+      element_clear(&Di);
+   }
+   element_clear(&Cs);
+}
+
+BOOST_FIXTURE_TEST_CASE(boundedDecryptionConcurrent, InitGenerator) {
+   auto key = keyGeneration(priv, root);
+   vector<int> encAttr {1, 4};
+   element_s Cs;
+   auto Cw = createSecret(pub, encAttr, Cs);
+   uint8_t expected[32];
+   hashElement(&Cs, expected);
+
+   // Bounded calls on two threads while a third one uses PBC on the heap.
+   bool ok[3] = { true, true, true };
+   vector<thread> threads;
+   for(int t = 0; t < 2; ++t) {
+      threads.emplace_back([&, t] {
+         vector<uint8_t> scratch(boundedScratchSize(root));
+         uint8_t fileKey[32];
+         for(int i = 0; i < 20; ++i) {
+            ok[t] &= recoverKeyBounded(key, Cw, encAttr, scratch.data(), scratch.size(), fileKey)
+                     && !memcmp(expected, fileKey, sizeof(fileKey));
+         }
+      });
+   }
+   threads.emplace_back([&] {
+      for(int i = 0; i < 20; ++i) {
+         element_s CsHeap, CsDec;
+         auto CwHeap = createSecret(pub, encAttr, CsHeap);
+         recoverSecret(key, CwHeap, encAttr, CsDec);
+         ok[2] &= !element_cmp(&CsHeap, &CsDec);
+         for(auto& attrCiPair: CwHeap) {
+            element_clear(&attrCiPair.second);
+         }
+         element_clear(&CsHeap);
+         element_clear(&CsDec);
+      }
+   });
+   for(auto& worker: threads) {
+      worker.join();
+   }
+   BOOST_CHECK(ok[0] && ok[1] && ok[2]);
+
+   for(auto& attrCiPair: Cw) {
+      element_clear(&attrCiPair.second);
+   }
+   for(auto& Di: key.Di) {
+      element_clear(&Di);
+   }
+   element_clear(&Cs);
+}
+
+BOOST_FIXTURE_TEST_CASE(subgroupCheck, InitGenerator) {
+   element_s Cs;
+   vector<int> encAttr {1, 2, 3};
+   auto Cw = createSecret(pub, encAttr, Cs);
+   for(auto& attrCiPair: Cw) {
+      BOOST_CHECK(isInG1Subgroup(&attrCiPair.second));
+   }
+
+   // (0, 0) is on y^2 = x^3 + x and has order 2.
+   uint8_t bytes[128] = { 0 };
+   element_t point;
+   element_init_G1(point, getPairing());
+   element_from_bytes(point, bytes);
+   BOOST_CHECK(!isInG1Subgroup(point));
+
+   // (1, 1) is not on the curve.
+   bytes[63] = 1;
+   bytes[127] = 1;
+   element_from_bytes(point, bytes);
+   BOOST_CHECK(!isInG1Subgroup(point));
+
+   // A ciphertext header with one point replaced by (0, 0).
+   BOOST_CHECK(isValidCw(Cw));
+   memset(bytes, 0, sizeof(bytes));
+   element_from_bytes(&Cw[2], bytes);
+   vector<uint8_t> header;
+   serializeCw(Cw, header);
+   Cw_t tampered;
+   deserializeCw(header.data(), header.size(), tampered);
+   BOOST_CHECK(!isValidCw(tampered));
+   for(auto& attrCiPair: tampered) {
+      element_clear(&attrCiPair.second);
+   }
+
+   element_clear(point);
+   element_clear(&Cs);
+   for(auto& attrCiPair: Cw) {
+      element_clear(&attrCiPair.second);
+   }
+}
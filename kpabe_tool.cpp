@@ -0,0 +1,78 @@
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "kpabe_tool.hpp"
+
+using namespace std;
+
+vector<uint8_t> readFile(const string& path) {
+   FILE* file = fopen(path.c_str(), "rb");
+   if(!file) {
+      throw runtime_error("Cannot open " + path + ": " + strerror(errno));
+   }
+   vector<uint8_t> data;
+   array<uint8_t, 1 << 16> buffer;
+   size_t n;
+   while((n = fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+      data.insert(data.end(), buffer.begin(), buffer.begin() + n);
+   }
+   const bool failed = ferror(file);
+   fclose(file);
+   if(failed) {
+      throw runtime_error("Cannot read " + path);
+   }
+   return data;
+}
+
+/**
+ * Parses a whole string as an int, rejecting trailing characters.
+ */
+static int parseAttribute(const string& text, const string& list) {
+   size_t parsed = 0;
+   int value = 0;
+   try {
+      value = stoi(text, &parsed);
+   } catch(const logic_error&) {
+      parsed = 0;
+   }
+   if(parsed == 0 || parsed != text.size()) {
+      throw invalid_argument("Invalid attribute list: " + list);
+   }
+   return value;
+}
+
+vector<int> parseAttributeList(const string& list) {
+   if(list.empty()) {
+      throw invalid_argument("Empty attribute list");
+   }
+   vector<int> attributes;
+   size_t pos = 0;
+   while(pos <= list.size()) {
+      size_t end = list.find(',', pos);
+      if(end == string::npos) {
+         end = list.size();
+      }
+      const string item = list.substr(pos, end - pos);
+      // A leading '-' is a sign, not a range.
+      const size_t dash = item.find('-', 1);
+      if(dash == string::npos) {
+         attributes.push_back(parseAttribute(item, list));
+      } else {
+         const int first = parseAttribute(item.substr(0, dash), list);
+         const int last = parseAttribute(item.substr(dash + 1), list);
+         if(first > last) {
+            throw invalid_argument("Invalid attribute list: " + list);
+         }
+         for(long long attr = first; attr <= last; ++attr) {
+            attributes.push_back(static_cast<int>(attr));
+         }
+      }
+      pos = end + 1;
+   }
+   return attributes;
+}
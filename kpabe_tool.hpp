@@ -0,0 +1,27 @@
+#ifndef kpabe_tool_
+#define kpabe_tool_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Helpers shared by the command-line tools (kpabe, kpabed and kpabe_load).
+ */
+
+/**
+ * @brief Reads a whole file.
+ *
+ * @throws std::runtime_error if the file cannot be opened or read.
+ */
+std::vector<uint8_t> readFile(const std::string& path);
+
+/**
+ * @brief Parses an attribute list such as "1,2,10-20".
+ *
+ * @throws std::invalid_argument if the list is empty, an item is not an integer or a
+ * range is reversed.
+ */
+std::vector<int> parseAttributeList(const std::string& list);
+
+#endif
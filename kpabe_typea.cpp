@@ -0,0 +1,392 @@
+#include <cstring>
+
+#include "kpabe_typea.hpp"
+
+namespace typea {
+
+typedef unsigned __int128 uint128_t;
+
+// q from TYPE_A_PARAMS.
+static const Fp Q = {{
+   0xcf6230c28e284d97ULL, 0x2539e8ff9b4f30a3ULL, 0x459e54dab7ba5be9ULL, 0xa7afdaf9b049744aULL,
+   0x28d1f80010940622ULL, 0x364bb946f5ed8396ULL, 0x6edef8ce96e7217eULL, 0xa7a73868e95fba88ULL
+}};
+
+// -q^-1 mod 2^64
+static const uint64_t Q_INV = 0xc1fc53896318fdd9ULL;
+
+// 2^1024 mod q, converts into Montgomery form.
+static const Fp R2 = {{
+   0xde1edb425a3ca657ULL, 0x7eff257402de9a1dULL, 0x1f0d551eb7d063c8ULL, 0xea1c555261184d6aULL,
+   0x6238350cf8d89111ULL, 0xf227d4a91dd70835ULL, 0x9e1b11b7775a00dbULL, 0x96ff57c172d7593dULL
+}};
+
+// 2^512 mod q, i.e. 1 in Montgomery form.
+static const Fp ONE = {{
+   0x309dcf3d71d7b269ULL, 0xdac6170064b0cf5cULL, 0xba61ab254845a416ULL, 0x585025064fb68bb5ULL,
+   0xd72e07ffef6bf9ddULL, 0xc9b446b90a127c69ULL, 0x912107316918de81ULL, 0x5858c79716a04577ULL
+}};
+
+static const Fp ZERO = {{ 0 }};
+
+/**
+ * t[0..LIMBS - 1] += a * b. Returns the word that overflows past t[LIMBS - 1].
+ */
+static inline uint64_t mulAddRow(uint64_t* t, const uint64_t* a, uint64_t b) {
+   uint64_t carry = 0;
+   for(size_t j = 0; j < LIMBS; ++j) {
+      uint128_t acc = static_cast<uint128_t>(a[j]) * b + t[j] + carry;
+      t[j] = static_cast<uint64_t>(acc);
+      carry = static_cast<uint64_t>(acc >> 64);
+   }
+   return carry;
+}
+
+static inline uint64_t addLimbs(uint64_t* out, const uint64_t* a, const uint64_t* b) {
+   uint64_t carry = 0;
+   for(size_t i = 0; i < LIMBS; ++i) {
+      uint128_t acc = static_cast<uint128_t>(a[i]) + b[i] + carry;
+      out[i] = static_cast<uint64_t>(acc);
+      carry = static_cast<uint64_t>(acc >> 64);
+   }
+   return carry;
+}
+
+static inline uint64_t subLimbs(uint64_t* out, const uint64_t* a, const uint64_t* b) {
+   uint64_t borrow = 0;
+   for(size_t i = 0; i < LIMBS; ++i) {
+      uint128_t diff = static_cast<uint128_t>(a[i]) - b[i] - borrow;
+      out[i] = static_cast<uint64_t>(diff);
+      borrow = static_cast<uint64_t>(diff >> 64) & 1;
+   }
+   return borrow;
+}
+
+static inline bool lessThanQ(const uint64_t* a) {
+   for(size_t i = LIMBS; i-- > 0;) {
+      if(a[i] != Q.limb[i]) {
+         return a[i] < Q.limb[i];
+      }
+   }
+   return false;
+}
+
+/**
+ * Montgomery reduction: out = T * 2^-512 mod q for T < q * 2^512.
+ */
+static void reduce(Fp& out, uint64_t* T) {
+   uint64_t extra = 0; // The bit above T[2 * LIMBS - 1].
+   for(size_t i = 0; i < LIMBS; ++i) {
+      const uint64_t m = T[i] * Q_INV;
+      uint64_t carry = mulAddRow(T + i, Q.limb, m);
+      for(size_t k = i + LIMBS; k < 2 * LIMBS && carry; ++k) {
+         T[k] += carry;
+         carry = T[k] < carry;
+      }
+      extra += carry;
+   }
+
+   // The result is below 2q, so one conditional subtraction suffices.
+   uint64_t* result = T + LIMBS;
+   if(extra || !lessThanQ(result)) {
+      subLimbs(out.limb, result, Q.limb);
+   } else {
+      memcpy(out.limb, result, sizeof(out.limb));
+   }
+}
+
+void fpMul(Fp& out, const Fp& a, const Fp& b) {
+   uint64_t T[2 * LIMBS] = { 0 };
+   for(size_t i = 0; i < LIMBS; ++i) {
+      T[i + LIMBS] = mulAddRow(T + i, a.limb, b.limb[i]);
+   }
+   reduce(out, T);
+}
+
+void fpSqr(Fp& out, const Fp& a) {
+   uint64_t T[2 * LIMBS] = { 0 };
+
+   // Cross products a[i] * a[j] for i < j, computed once and doubled.
+   for(size_t i = 0; i + 1 < LIMBS; ++i) {
+      uint64_t carry = 0;
+      for(size_t j = i + 1; j < LIMBS; ++j) {
+         uint128_t acc = static_cast<uint128_t>(a.limb[i]) * a.limb[j] + T[i + j] + carry;
+         T[i + j] = static_cast<uint64_t>(acc);
+         carry = static_cast<uint64_t>(acc >> 64);
+      }
+      T[i + LIMBS] = carry;
+   }
+   for(size_t i = 2 * LIMBS - 1; i > 0; --i) {
+      T[i] = (T[i] << 1) | (T[i - 1] >> 63);
+   }
+   T[0] <<= 1;
+
+   // Diagonal a[i]^2.
+   uint64_t carry = 0;
+   for(size_t i = 0; i < LIMBS; ++i) {
+      uint128_t square = static_cast<uint128_t>(a.limb[i]) * a.limb[i];
+      uint128_t acc = static_cast<uint128_t>(T[2 * i]) + static_cast<uint64_t>(square) + carry;
+      T[2 * i] = static_cast<uint64_t>(acc);
+      acc = static_cast<uint128_t>(T[2 * i + 1]) + static_cast<uint64_t>(square >> 64) +
+            static_cast<uint64_t>(acc >> 64);
+      T[2 * i + 1] = static_cast<uint64_t>(acc);
+      carry = static_cast<uint64_t>(acc >> 64);
+   }
+
+   reduce(out, T);
+}
+
+void fpAdd(Fp& out, const Fp& a, const Fp& b) {
+   uint64_t carry = addLimbs(out.limb, a.limb, b.limb);
+   if(carry || !lessThanQ(out.limb)) {
+      subLimbs(out.limb, out.limb, Q.limb);
+   }
+}
+
+void fpSub(Fp& out, const Fp& a, const Fp& b) {
+   if(subLimbs(out.limb, a.limb, b.limb)) {
+      addLimbs(out.limb, out.limb, Q.limb);
+   }
+}
+
+bool fpIsZero(const Fp& a) {
+   uint64_t acc = 0;
+   for(size_t i = 0; i < LIMBS; ++i) {
+      acc |= a.limb[i];
+   }
+   return acc == 0;
+}
+
+void fpInv(Fp& out, const Fp& a) {
+   // Fermat: a^(q - 2). q is odd and its lowest limb is large, so no borrow.
+   Fp exponent = Q;
+   exponent.limb[0] -= 2;
+
+   Fp result = ONE;
+   for(size_t bit = LIMBS * 64; bit-- > 0;) {
+      fpSqr(result, result);
+      if((exponent.limb[bit / 64] >> (bit % 64)) & 1) {
+         fpMul(result, result, a);
+      }
+   }
+   out = result;
+}
+
+bool fpFromBytes(Fp& out, const uint8_t* bytes) {
+   Fp plain;
+   for(size_t i = 0; i < LIMBS; ++i) {
+      uint64_t word = 0;
+      for(size_t b = 0; b < 8; ++b) {
+         word = (word << 8) | bytes[(LIMBS - 1 - i) * 8 + b];
+      }
+      plain.limb[i] = word;
+   }
+   if(!lessThanQ(plain.limb)) {
+      return false;
+   }
+   fpMul(out, plain, R2);
+   return true;
+}
+
+void fpToBytes(uint8_t* bytes, const Fp& a) {
+   uint64_t T[2 * LIMBS] = { 0 };
+   memcpy(T, a.limb, sizeof(a.limb));
+   Fp plain;
+   reduce(plain, T);
+   for(size_t i = 0; i < LIMBS; ++i) {
+      uint64_t word = plain.limb[i];
+      for(size_t b = 8; b-- > 0;) {
+         bytes[(LIMBS - 1 - i) * 8 + b] = static_cast<uint8_t>(word);
+         word >>= 8;
+      }
+   }
+}
+
+// Points
+
+/**
+ * A point in Jacobian coordinates (x = X / Z^2, y = Y / Z^3). Z = 0 is the point at
+ * infinity.
+ */
+struct JacobianPoint {
+   Fp X, Y, Z;
+};
+
+/**
+ * dbl-2007-bl for y^2 = x^3 + a * x + b with a = 1.
+ */
+static void pointDouble(JacobianPoint& p) {
+   Fp XX, YY, YYYY, ZZ, S, M, T, tmp;
+   fpSqr(XX, p.X);
+   fpSqr(YY, p.Y);
+   fpSqr(YYYY, YY);
+   fpSqr(ZZ, p.Z);
+
+   // S = 2 * ((X + YY)^2 - XX - YYYY)
+   fpAdd(S, p.X, YY);
+   fpSqr(S, S);
+   fpSub(S, S, XX);
+   fpSub(S, S, YYYY);
+   fpAdd(S, S, S);
+
+   // M = 3 * XX + a * ZZ^2
+   fpSqr(M, ZZ);
+   fpAdd(M, M, XX);
+   fpAdd(M, M, XX);
+   fpAdd(M, M, XX);
+
+   // T = M^2 - 2 * S
+   fpSqr(T, M);
+   fpSub(T, T, S);
+   fpSub(T, T, S);
+
+   // Z3 = (Y + Z)^2 - YY - ZZ
+   fpAdd(p.Z, p.Y, p.Z);
+   fpSqr(p.Z, p.Z);
+   fpSub(p.Z, p.Z, YY);
+   fpSub(p.Z, p.Z, ZZ);
+
+   // Y3 = M * (S - T) - 8 * YYYY
+   fpSub(tmp, S, T);
+   fpMul(p.Y, M, tmp);
+   fpAdd(YYYY, YYYY, YYYY);
+   fpAdd(YYYY, YYYY, YYYY);
+   fpAdd(YYYY, YYYY, YYYY);
+   fpSub(p.Y, p.Y, YYYY);
+
+   p.X = T;
+}
+
+/**
+ * madd-2007-bl: p += q where q is affine and not the point at infinity.
+ */
+static void pointAddMixed(JacobianPoint& p, const AffinePoint& q) {
+   if(fpIsZero(p.Z)) {
+      p.X = q.x;
+      p.Y = q.y;
+      p.Z = ONE;
+      return;
+   }
+
+   Fp Z1Z1, U2, S2, H, HH, I, J, r, V, tmp;
+   fpSqr(Z1Z1, p.Z);
+   fpMul(U2, q.x, Z1Z1);
+   fpMul(S2, q.y, p.Z);
+   fpMul(S2, S2, Z1Z1);
+
+   fpSub(H, U2, p.X);
+   fpSub(r, S2, p.Y);
+   if(fpIsZero(H)) {
+      if(fpIsZero(r)) {
+         pointDouble(p);
+      } else {
+         p.Z = ZERO;
+      }
+      return;
+   }
+   fpAdd(r, r, r);
+
+   fpSqr(HH, H);
+   fpAdd(I, HH, HH);
+   fpAdd(I, I, I);
+   fpMul(J, H, I);
+   fpMul(V, p.X, I);
+
+   // Z3 = (Z1 + H)^2 - Z1Z1 - HH
+   fpAdd(p.Z, p.Z, H);
+   fpSqr(p.Z, p.Z);
+   fpSub(p.Z, p.Z, Z1Z1);
+   fpSub(p.Z, p.Z, HH);
+
+   // Y3 = r * (V - X3) - 2 * Y1 * J, with X3 = r^2 - J - 2 * V
+   fpMul(tmp, p.Y, J);
+   fpAdd(tmp, tmp, tmp);
+   fpSqr(p.X, r);
+   fpSub(p.X, p.X, J);
+   fpSub(p.X, p.X, V);
+   fpSub(p.X, p.X, V);
+   fpSub(V, V, p.X);
+   fpMul(p.Y, r, V);
+   fpSub(p.Y, p.Y, tmp);
+}
+
+/**
+ * Computes the non-adjacent form of a big-endian scalar, least significant digit
+ * first. Returns the number of digits.
+ */
+static size_t nonAdjacentForm(int8_t* digits, const uint8_t* scalar, size_t scalarLen) {
+   // One spare limb for the carry of k + 1.
+   const size_t scalarLimbs = 5;
+   uint64_t k[scalarLimbs] = { 0 };
+   for(size_t i = 0; i < scalarLen; ++i) {
+      const size_t byteIndex = scalarLen - 1 - i;
+      k[i / 8] |= static_cast<uint64_t>(scalar[byteIndex]) << (8 * (i % 8));
+   }
+
+   size_t count = 0;
+   for(;;) {
+      bool isZero = true;
+      for(auto limb: k) {
+         isZero = isZero && limb == 0;
+      }
+      if(isZero) {
+         break;
+      }
+
+      int8_t digit = 0;
+      if(k[0] & 1) {
+         digit = (k[0] & 3) == 1 ? 1 : -1;
+         if(digit == 1) {
+            k[0] -= 1;
+         } else {
+            for(size_t i = 0; i < scalarLimbs && ++k[i] == 0; ++i) { }
+         }
+      }
+      digits[count++] = digit;
+      for(size_t i = 0; i < scalarLimbs; ++i) {
+         k[i] = (k[i] >> 1) | (i + 1 < scalarLimbs ? k[i + 1] << 63 : 0);
+      }
+   }
+   return count;
+}
+
+void scalarMul(AffinePoint& out, const AffinePoint& base,
+               const uint8_t* scalar, size_t scalarLen) {
+   int8_t digits[32 * 8 + 1];
+   const size_t digitCount = base.infinity ? 0 : nonAdjacentForm(digits, scalar, scalarLen);
+
+   AffinePoint negBase = base;
+   fpSub(negBase.y, ZERO, base.y);
+
+   JacobianPoint acc;
+   acc.X = ONE;
+   acc.Y = ONE;
+   acc.Z = ZERO;
+   for(size_t i = digitCount; i-- > 0;) {
+      if(!fpIsZero(acc.Z)) {
+         pointDouble(acc);
+      }
+      if(digits[i] == 1) {
+         pointAddMixed(acc, base);
+      } else if(digits[i] == -1) {
+         pointAddMixed(acc, negBase);
+      }
+   }
+
+   if(fpIsZero(acc.Z)) {
+      out.infinity = true;
+      out.x = ZERO;
+      out.y = ZERO;
+      return;
+   }
+
+   Fp zInv, zInv2;
+   fpInv(zInv, acc.Z);
+   fpSqr(zInv2, zInv);
+   fpMul(out.x, acc.X, zInv2);
+   fpMul(zInv2, zInv2, zInv);
+   fpMul(out.y, acc.Y, zInv2);
+   out.infinity = false;
+}
+
+} // namespace typea
@@ -0,0 +1,61 @@
+#ifndef kpabe_typea_
+#define kpabe_typea_
+
+#include <cstddef>
+#include <cstdint>
+
+#pragma GCC visibility push(default)
+
+/*
+ * Fixed-width arithmetic for the curve y^2 = x^3 + x over the 512-bit prime q of
+ * TYPE_A_PARAMS.
+ *
+ * Field elements are 8 64-bit limbs (little-endian) in Montgomery form and live on the
+ * stack; nothing here allocates. Points are kept in Jacobian coordinates while
+ * computing and normalized to affine coordinates only at the end.
+ */
+namespace typea {
+
+static const size_t LIMBS = 8;
+static const size_t FIELD_BYTES = 64;
+
+struct Fp {
+   uint64_t limb[LIMBS];
+};
+
+/**
+ * @brief Converts a big-endian integer in [0, q) to Montgomery form.
+ *
+ * @return false if the integer is not reduced.
+ */
+bool fpFromBytes(Fp& out, const uint8_t* bytes);
+
+/**
+ * @brief Writes the canonical big-endian representation of a field element.
+ */
+void fpToBytes(uint8_t* bytes, const Fp& a);
+
+void fpAdd(Fp& out, const Fp& a, const Fp& b);
+void fpSub(Fp& out, const Fp& a, const Fp& b);
+void fpMul(Fp& out, const Fp& a, const Fp& b);
+void fpSqr(Fp& out, const Fp& a);
+void fpInv(Fp& out, const Fp& a);
+bool fpIsZero(const Fp& a);
+
+struct AffinePoint {
+   Fp x, y;
+   bool infinity;
+};
+
+/**
+ * @brief Computes out = scalar * base.
+ *
+ * @param scalar A big-endian unsigned integer of at most 32 bytes.
+ */
+void scalarMul(AffinePoint& out, const AffinePoint& base,
+               const uint8_t* scalar, size_t scalarLen);
+
+} // namespace typea
+
+#pragma GCC visibility pop
+#endif
@@ -0,0 +1,358 @@
+/*
+ * kpabed - local KP-ABE decryption daemon.
+ *
+ *    kpabed [-j threads] [-p plan-cache-size] [-q queue-length] <socket-path> <key>...
+ *
+ * Holds the given decryption keys (numbered from 0 in the order given) and answers
+ * decrypt requests on a Unix domain socket; see kpabed_protocol.hpp for the format.
+ * Requests that arrive while the queue is full are answered with BUSY.
+ *
+ * Evaluating a policy only depends on the key and the attribute set of a ciphertext.
+ * The resulting DecryptionPlans are cached, and concurrent requests for the same key
+ * and attribute set wait for a single evaluation instead of repeating it.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <pbc.h>
+
+#include "kpabe.hpp"
+#include "kpabe_tool.hpp"
+#include "kpabed_protocol.hpp"
+
+using namespace std;
+
+static const size_t DEFAULT_PLAN_CACHE_SIZE = 4096;
+static const size_t DEFAULT_QUEUE_LENGTH = 1024;
+
+struct Connection {
+   int fd;
+   mutex writeLock;
+
+   explicit Connection(int fd): fd(fd) { }
+
+   ~Connection() {
+      close(fd);
+   }
+
+   void respond(uint32_t id, kpabed::Status status, const uint8_t* fileKey) {
+      vector<uint8_t> frame(4);
+      kpabed::putU32(frame, id);
+      frame.push_back(status);
+      if(fileKey) {
+         frame.insert(frame.end(), fileKey, fileKey + kpabed::FILE_KEY_SIZE);
+      }
+      lock_guard<mutex> guard(writeLock);
+      kpabed::writeFrame(fd, frame);
+   }
+};
+
+struct Request {
+   shared_ptr<Connection> connection;
+   uint32_t id;
+   uint32_t keyIndex;
+   vector<uint8_t> body;
+};
+
+/**
+ * LRU cache of decryption plans per (key, attribute set) with request coalescing.
+ */
+class PlanCache {
+   typedef pair< uint32_t, vector<int> > CacheKey;
+   // A null plan means the attributes do not satisfy the policy.
+   typedef shared_future< shared_ptr<DecryptionPlan> > PlanFuture;
+
+   struct Entry {
+      PlanFuture plan;
+      list<CacheKey>::iterator lruPosition;
+   };
+
+   mutex lock;
+   map<CacheKey, Entry> entries;
+   list<CacheKey> lru;
+   const size_t capacity;
+
+public:
+   atomic<unsigned long> evaluations {0};
+   atomic<unsigned long> lookups {0};
+
+   explicit PlanCache(size_t capacity): capacity(max<size_t>(1, capacity)) { }
+
+   shared_ptr<DecryptionPlan> get(uint32_t keyIndex, vector<int> attributes,
+                                  DecryptionKey& key) {
+      ++lookups;
+      sort(attributes.begin(), attributes.end());
+      CacheKey cacheKey(keyIndex, attributes);
+
+      promise< shared_ptr<DecryptionPlan> > evaluation;
+      unique_lock<mutex> guard(lock);
+      auto entryIter = entries.find(cacheKey);
+      if(entryIter != entries.end()) {
+         lru.splice(lru.begin(), lru, entryIter->second.lruPosition);
+         PlanFuture plan = entryIter->second.plan;
+         guard.unlock();
+         // The evaluation may still be in flight on another worker.
+         return plan.get();
+      }
+
+      lru.push_front(cacheKey);
+      entries[cacheKey] = Entry {evaluation.get_future().share(), lru.begin()};
+      if(entries.size() > capacity) {
+         entries.erase(lru.back());
+         lru.pop_back();
+      }
+      guard.unlock();
+
+      ++evaluations;
+      shared_ptr<DecryptionPlan> plan;
+      try {
+         plan = make_shared<DecryptionPlan>(planDecryption(key, attributes));
+      } catch(const UnsatError&) {
+      } catch(...) {
+         // Waiters get the same error; the next request evaluates again.
+         evaluation.set_exception(current_exception());
+         forget(cacheKey);
+         throw;
+      }
+      evaluation.set_value(plan);
+      return plan;
+   }
+
+private:
+   void forget(const CacheKey& cacheKey) {
+      lock_guard<mutex> guard(lock);
+      auto entryIter = entries.find(cacheKey);
+      if(entryIter != entries.end()) {
+         lru.erase(entryIter->second.lruPosition);
+         entries.erase(entryIter);
+      }
+   }
+};
+
+class Daemon {
+   vector< unique_ptr<DecryptionKey> >& keys;
+   PlanCache plans;
+
+   mutex queueLock;
+   condition_variable queueReady;
+   deque<Request> queue;
+   const size_t maxQueueLength;
+
+public:
+   atomic<unsigned long> served {0};
+   atomic<unsigned long> rejected {0};
+
+   Daemon(vector< unique_ptr<DecryptionKey> >& keys, size_t planCacheSize,
+          size_t maxQueueLength):
+      keys(keys), plans(planCacheSize), maxQueueLength(maxQueueLength) { }
+
+   void submit(Request request) {
+      {
+         lock_guard<mutex> guard(queueLock);
+         if(queue.size() < maxQueueLength) {
+            queue.push_back(move(request));
+            queueReady.notify_one();
+            return;
+         }
+      }
+      ++rejected;
+      request.connection->respond(request.id, kpabed::BUSY, nullptr);
+   }
+
+   void handle(Request& request) {
+      if(request.keyIndex >= keys.size()) {
+         request.connection->respond(request.id, kpabed::UNKNOWN_KEY, nullptr);
+         return;
+      }
+
+      Cw_t Cw;
+      bool valid = true;
+      try {
+         deserializeCw(request.body.data(), request.body.size(), Cw);
+      } catch(const invalid_argument&) {
+         valid = false;
+      }
+      // The response depends on P(Ci ^ exponent): points outside the order-r subgroup
+      // would leak the key's exponents modulo their small order.
+      valid = valid && isValidCw(Cw);
+      if(!valid) {
+         for(auto& attrCiPair: Cw) {
+            element_clear(&attrCiPair.second);
+         }
+         request.connection->respond(request.id, kpabed::BAD_REQUEST, nullptr);
+         return;
+      }
+
+      vector<int> attributes;
+      attributes.reserve(Cw.size());
+      for(auto& attrCiPair: Cw) {
+         attributes.push_back(attrCiPair.first);
+      }
+
+      shared_ptr<DecryptionPlan> plan;
+      kpabed::Status failure = kpabed::UNSATISFIED;
+      try {
+         plan = plans.get(request.keyIndex, attributes, *keys[request.keyIndex]);
+      } catch(const exception& e) {
+         cerr << "Request " << request.id << ": " << e.what() << endl;
+         failure = kpabed::BAD_REQUEST;
+      }
+      if(!plan) {
+         request.connection->respond(request.id, failure, nullptr);
+      } else {
+         element_s Cs;
+         applyDecryption(*plan, Cw, Cs);
+         uint8_t fileKey[kpabed::FILE_KEY_SIZE];
+         hashElement(&Cs, fileKey);
+         element_clear(&Cs);
+         request.connection->respond(request.id, kpabed::OK, fileKey);
+         memset(fileKey, 0, sizeof(fileKey));
+      }
+
+      for(auto& attrCiPair: Cw) {
+         element_clear(&attrCiPair.second);
+      }
+      ++served;
+   }
+
+   void work() {
+      for(;;) {
+         Request request;
+         {
+            unique_lock<mutex> guard(queueLock);
+            queueReady.wait(guard, [this] { return !queue.empty(); });
+            request = move(queue.front());
+            queue.pop_front();
+         }
+         handle(request);
+      }
+   }
+
+   void readRequests(shared_ptr<Connection> connection) {
+      vector<uint8_t> body;
+      while(kpabed::readFrame(connection->fd, body)) {
+         if(body.size() < 8) {
+            break;
+         }
+         Request request;
+         request.connection = connection;
+         request.id = kpabed::getU32(body.data());
+         request.keyIndex = kpabed::getU32(body.data() + 4);
+         request.body.assign(body.begin() + 8, body.end());
+         submit(move(request));
+      }
+      shutdown(connection->fd, SHUT_RD);
+   }
+
+   void printStats() {
+      printf("served %lu, busy %lu, policy evaluations %lu, plan lookups %lu\n",
+             served.load(), rejected.load(), plans.evaluations.load(), plans.lookups.load());
+      fflush(stdout);
+   }
+};
+
+static unique_ptr<DecryptionKey> loadKey(const string& path) {
+   const auto data = readFile(path);
+   unique_ptr<DecryptionKey> key(new DecryptionKey(Node(0)));
+   deserializeKey(data.data(), data.size(), *key);
+   return key;
+}
+
+int main(int argc, char** argv) {
+   vector<string> args(argv + 1, argv + argc);
+   size_t threads = max(1u, thread::hardware_concurrency());
+   size_t planCacheSize = DEFAULT_PLAN_CACHE_SIZE;
+   size_t queueLength = DEFAULT_QUEUE_LENGTH;
+   while(args.size() >= 2 && (args[0] == "-j" || args[0] == "-p" || args[0] == "-q")) {
+      const size_t value = max(1, atoi(args[1].c_str()));
+      (args[0] == "-j" ? threads : args[0] == "-p" ? planCacheSize : queueLength) = value;
+      args.erase(args.begin(), args.begin() + 2);
+   }
+   if(args.size() < 2) {
+      cerr << "usage: kpabed [-j threads] [-p plan-cache-size] [-q queue-length] "
+              "<socket-path> <key>..." << endl;
+      return 2;
+   }
+
+   signal(SIGPIPE, SIG_IGN);
+   getPairing();
+
+   vector< unique_ptr<DecryptionKey> > keys;
+   try {
+      for(auto keyPath = args.begin() + 1; keyPath != args.end(); ++keyPath) {
+         keys.push_back(loadKey(*keyPath));
+      }
+   } catch(const exception& e) {
+      cerr << e.what() << endl;
+      return 1;
+   }
+
+   const string& socketPath = args[0];
+   sockaddr_un address;
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   if(socketPath.size() >= sizeof(address.sun_path)) {
+      cerr << "Socket path too long" << endl;
+      return 1;
+   }
+   strcpy(address.sun_path, socketPath.c_str());
+   unlink(socketPath.c_str());
+
+   const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(listener < 0 ||
+      ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      listen(listener, SOMAXCONN) != 0) {
+      cerr << "Cannot listen on " << socketPath << ": " << strerror(errno) << endl;
+      return 1;
+   }
+   printf("kpabed: %zu keys, %zu workers, listening on %s\n",
+          keys.size(), threads, socketPath.c_str());
+   fflush(stdout);
+
+   Daemon daemon(keys, planCacheSize, queueLength);
+   for(size_t i = 0; i < threads; ++i) {
+      thread(&Daemon::work, &daemon).detach();
+   }
+   thread([&daemon] {
+      unsigned long last = 0;
+      for(;;) {
+         this_thread::sleep_for(chrono::seconds(10));
+         if(daemon.served + daemon.rejected != last) {
+            last = daemon.served + daemon.rejected;
+            daemon.printStats();
+         }
+      }
+   }).detach();
+
+   for(;;) {
+      const int fd = accept(listener, nullptr, nullptr);
+      if(fd < 0) {
+         if(errno == EINTR) {
+            continue;
+         }
+         cerr << "accept: " << strerror(errno) << endl;
+         return 1;
+      }
+      thread(&Daemon::readRequests, &daemon, make_shared<Connection>(fd)).detach();
+   }
+}
@@ -0,0 +1,103 @@
+#ifndef kpabed_protocol_
+#define kpabed_protocol_
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <unistd.h>
+
+/*
+ * Wire protocol of the kpabed decryption daemon (Unix domain stream socket).
+ *
+ * All integers are little-endian. Every message is a frame: a u32 length of the rest of
+ * the frame, followed by the body. Requests can be pipelined; responses carry the id of
+ * their request and can arrive out of order.
+ *
+ *    request:  u32 id | u32 key index | serialized Cw (see serializeCw)
+ *    response: u32 id | u8 status | 32-byte file key (SHA-256 of the secret, status OK only)
+ */
+namespace kpabed {
+
+static const uint32_t MAX_FRAME = 1 << 20;
+static const size_t FILE_KEY_SIZE = 32;
+
+enum Status: uint8_t {
+   OK = 0,
+   UNSATISFIED = 1,
+   BAD_REQUEST = 2, // Malformed, or a point of Cw is not in the order-r subgroup.
+   UNKNOWN_KEY = 3,
+   BUSY = 4,        // The request queue is full; retry later.
+};
+
+inline void putU32(std::vector<uint8_t>& out, uint32_t value) {
+   for(int i = 0; i < 4; ++i) {
+      out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+   }
+}
+
+inline uint32_t getU32(const uint8_t* bytes) {
+   return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | static_cast<uint32_t>(bytes[3]) << 24;
+}
+
+inline bool readFull(int fd, uint8_t* data, size_t len) {
+   while(len > 0) {
+      const ssize_t n = read(fd, data, len);
+      if(n < 0 && errno == EINTR) {
+         continue;
+      }
+      if(n <= 0) {
+         return false;
+      }
+      data += n;
+      len -= n;
+   }
+   return true;
+}
+
+inline bool writeFull(int fd, const uint8_t* data, size_t len) {
+   while(len > 0) {
+      const ssize_t n = write(fd, data, len);
+      if(n < 0 && errno == EINTR) {
+         continue;
+      }
+      if(n <= 0) {
+         return false;
+      }
+      data += n;
+      len -= n;
+   }
+   return true;
+}
+
+/**
+ * Reads one frame body. Returns false on EOF, errors and oversized frames.
+ */
+inline bool readFrame(int fd, std::vector<uint8_t>& body) {
+   uint8_t lengthBytes[4];
+   if(!readFull(fd, lengthBytes, sizeof(lengthBytes))) {
+      return false;
+   }
+   const uint32_t length = getU32(lengthBytes);
+   if(length > MAX_FRAME) {
+      return false;
+   }
+   body.resize(length);
+   return readFull(fd, body.data(), length);
+}
+
+/**
+ * Writes body as one frame. body must start with 4 reserved bytes for the length.
+ */
+inline bool writeFrame(int fd, std::vector<uint8_t>& frame) {
+   const uint32_t length = static_cast<uint32_t>(frame.size() - 4);
+   for(int i = 0; i < 4; ++i) {
+      frame[i] = static_cast<uint8_t>(length >> (8 * i));
+   }
+   return writeFull(fd, frame.data(), frame.size());
+}
+
+} // namespace kpabed
+
+#endif